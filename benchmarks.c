@@ -0,0 +1,696 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "bios.h"
+#include "util.h"
+#include "tinyos.h"
+#include "tinyoslib.h"
+#include "symposium.h"
+#include "kernel_sched.h"
+
+
+/*
+	A standalone program with microbenchmarks for tinyos3.
+
+	Each benchmark is a subcommand, e.g.,
+	  ./benchmarks switch 1000000
+	Run without arguments to list the benchmarks.
+ */
+
+
+/* Wall-clock time in seconds */
+static double now()
+{
+	struct timespec t;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &t));
+	return t.tv_sec + 1E-9 * t.tv_nsec;
+}
+
+
+/*
+	switch <count>
+
+	Measure the raw context switch of the BIOS: a context is switched
+	back and forth with the main context, without booting the VM.
+ */
+
+#define SWITCH_STACK_SIZE (64 * 1024)
+
+static cpu_context_t switch_main_ctx, switch_ctx;
+static volatile long switch_count;
+
+static void switch_loop()
+{
+	while (1) {
+		switch_count++;
+		cpu_swap_context(&switch_ctx, &switch_main_ctx);
+	}
+}
+
+static int bench_switch(int argc, const char** argv)
+{
+	long N = (argc > 0) ? atol(argv[0]) : 1000000;
+
+	void* stack = xmalloc(SWITCH_STACK_SIZE);
+	cpu_initialize_context(&switch_ctx, stack, SWITCH_STACK_SIZE, switch_loop);
+
+	switch_count = 0;
+	double t0 = now();
+	for (long i = 0; i < N; i++)
+		cpu_swap_context(&switch_main_ctx, &switch_ctx);
+	double dt = now() - t0;
+
+	free(stack);
+
+	/* Each iteration makes two switches */
+	printf("%ld switches in %.3f sec: %.0f switches/sec, %.1f nsec/switch\n",
+		2 * switch_count, dt, 2 * switch_count / dt, 1E9 * dt / (2 * switch_count));
+	return 0;
+}
+
+
+/*
+	fairness [philosophers] [bites] [hogs] [cores]
+
+	Compare the scheduling policies on a mixed workload: a symposium of 
+	philosopher threads (see symposium.c), which block often, runs alongside
+	a number of CPU-bound "hog" threads, which never block. For each policy,
+	report the time of the symposium, the spread of the finishing times of 
+	the philosophers, and the share of the CPU that each hog got. Fairness
+	is measured by Jain's index, which is 1 when all shares are equal and 
+	1/n when one of n threads gets everything.
+ */
+
+static struct {
+	SymposiumTable table;
+	int N, hogs;
+	double start;
+	double* finish; /* The finishing time of each philosopher */
+	unsigned long* work; /* The fibo() calls of each hog */
+	volatile int done; /* Set when the symposium is over */
+	int running; /* The number of running threads */
+	Mutex mx;
+	CondVar exited;
+} fair_bench;
+
+/* Jain's fairness index of n values */
+static double jain_index(int n, double* x)
+{
+	double sum = 0.0, sumsq = 0.0;
+	for (int i = 0; i < n; i++) {
+		sum += x[i];
+		sumsq += x[i] * x[i];
+	}
+	return (sumsq == 0.0) ? 1.0 : sum * sum / (n * sumsq);
+}
+
+static void fairness_thread_exit()
+{
+	Mutex_Lock(&fair_bench.mx);
+	fair_bench.running--;
+	Cond_Broadcast(&fair_bench.exited);
+	Mutex_Unlock(&fair_bench.mx);
+}
+
+static int fairness_philosopher(int i, void* args)
+{
+	SymposiumTable_philosopher(&fair_bench.table, i);
+	fair_bench.finish[i] = now() - fair_bench.start;
+	fairness_thread_exit();
+	return 0;
+}
+
+static int fairness_hog(int i, void* args)
+{
+	while (!fair_bench.done) {
+		fibo(20);
+		fair_bench.work[i]++;
+	}
+	fairness_thread_exit();
+	return 0;
+}
+
+static int fairness_boot(int argl, void* args)
+{
+	/* The philosophers print their state; stdout is not open, so this is discarded */
+	tinyos_replace_stdio();
+
+	fair_bench.running = fair_bench.N + fair_bench.hogs;
+	fair_bench.start = now();
+	for (int i = 0; i < fair_bench.hogs; i++)
+		CreateThread(fairness_hog, i, NULL);
+	for (int i = 0; i < fair_bench.N; i++)
+		CreateThread(fairness_philosopher, i, NULL);
+
+	Mutex_Lock(&fair_bench.mx);
+	while (fair_bench.running > fair_bench.hogs)
+		Cond_Wait(&fair_bench.mx, &fair_bench.exited);
+	fair_bench.done = 1;
+	while (fair_bench.running > 0)
+		Cond_Wait(&fair_bench.mx, &fair_bench.exited);
+	Mutex_Unlock(&fair_bench.mx);
+
+	tinyos_restore_stdio();
+	return 0;
+}
+
+static int bench_fairness(int argc, const char** argv)
+{
+	symposium_t symp;
+	symp.N = (argc > 0) ? atoi(argv[0]) : 5;
+	symp.bites = (argc > 1) ? atoi(argv[1]) : 5;
+	int hogs = (argc > 2) ? atoi(argv[2]) : 2;
+	int ncores = (argc > 3) ? atoi(argv[3]) : 1;
+	if (symp.N < 2 || symp.bites < 1 || hogs < 0 || ncores < 1 || ncores > MAX_CORES) {
+		fprintf(stderr, "fairness: bad arguments\n");
+		return 1;
+	}
+	adjust_symposium(&symp, -5, -5);
+
+	static const struct { sched_policy_t policy; const char* name; } policies[] = {
+		{ SCHED_POLICY_MLFQ, "mlfq" },
+		{ SCHED_POLICY_FAIR, "fair" }
+	};
+
+	printf("%d philosophers x %d bites (fibo %d..%d), %d hogs, %d cores\n",
+		symp.N, symp.bites, symp.fmin, symp.fmax, hogs, ncores);
+	printf("%-6s %10s %10s %10s %10s %12s %10s\n", 
+		"policy", "time", "first", "last", "jain(phil)", "hog work", "jain(hog)");
+
+	for (uint p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+		sched_policy_t old = set_sched_policy(policies[p].policy);
+
+		fair_bench.N = symp.N;
+		fair_bench.hogs = hogs;
+		fair_bench.finish = xmalloc(symp.N * sizeof(double));
+		fair_bench.work = xmalloc((hogs + 1) * sizeof(unsigned long));
+		for (int i = 0; i < hogs; i++)
+			fair_bench.work[i] = 0;
+		fair_bench.done = 0;
+		fair_bench.mx = MUTEX_INIT;
+		fair_bench.exited = COND_INIT;
+		SymposiumTable_init(&fair_bench.table, &symp);
+
+		boot(ncores, 0, fairness_boot, 0, NULL);
+
+		double first = fair_bench.finish[0], last = fair_bench.finish[0];
+		for (int i = 1; i < symp.N; i++) {
+			if (fair_bench.finish[i] < first) first = fair_bench.finish[i];
+			if (fair_bench.finish[i] > last) last = fair_bench.finish[i];
+		}
+		double* work = xmalloc((hogs + 1) * sizeof(double));
+		unsigned long total = 0;
+		for (int i = 0; i < hogs; i++) {
+			work[i] = fair_bench.work[i];
+			total += fair_bench.work[i];
+		}
+
+		printf("%-6s %10.3f %10.3f %10.3f %10.3f %12lu %10.3f\n", policies[p].name, last,
+			first, last, jain_index(symp.N, fair_bench.finish), total, 
+			hogs > 0 ? jain_index(hogs, work) : 1.0);
+
+		free(work);
+		SymposiumTable_destroy(&fair_bench.table);
+		free(fair_bench.finish);
+		free(fair_bench.work);
+		set_sched_policy(old);
+	}
+	return 0;
+}
+
+
+/*
+	pingpong [rounds] [hogs] [work] [mlfq|fair]
+
+	Two threads pass a token back and forth, with a mutex and two
+	condition variables, while a number of CPU-bound "hog" threads
+	compete for the core. With the token, a thread computes fibo(work), 
+	so that it is CPU-bound too. Report the round-trip time. When a thread 
+	signals and then blocks, the scheduler hands the core directly to 
+	the woken thread (build with -DSCHED_HANDOFF=0 to compare without).
+ */
+
+static struct {
+	long rounds;
+	int hogs;
+	int work;
+	int turn;
+	volatile int done;
+	int running;
+	Mutex mx;
+	CondVar cv[2];
+	CondVar exited;
+} pingpong;
+
+static void pingpong_exit()
+{
+	Mutex_Lock(&pingpong.mx);
+	pingpong.running--;
+	Cond_Broadcast(&pingpong.exited);
+	Mutex_Unlock(&pingpong.mx);
+}
+
+static int pingpong_player(int i, void* args)
+{
+	Mutex_Lock(&pingpong.mx);
+	for (long r = 0; r < pingpong.rounds; r++) {
+		while (pingpong.turn != i)
+			Cond_Wait(&pingpong.mx, &pingpong.cv[i]);
+		if (pingpong.work > 0)
+			fibo(pingpong.work);
+		pingpong.turn = 1 - i;
+		Cond_Signal(&pingpong.cv[1 - i]);
+	}
+	Mutex_Unlock(&pingpong.mx);
+	pingpong_exit();
+	return 0;
+}
+
+static int pingpong_hog(int i, void* args)
+{
+	while (!pingpong.done)
+		fibo(20);
+	pingpong_exit();
+	return 0;
+}
+
+static int pingpong_boot(int argl, void* args)
+{
+	pingpong.running = 2 + pingpong.hogs;
+	for (int i = 0; i < pingpong.hogs; i++)
+		CreateThread(pingpong_hog, i, NULL);
+
+	double t0 = now();
+	CreateThread(pingpong_player, 0, NULL);
+	CreateThread(pingpong_player, 1, NULL);
+
+	Mutex_Lock(&pingpong.mx);
+	while (pingpong.running > pingpong.hogs)
+		Cond_Wait(&pingpong.mx, &pingpong.exited);
+	double dt = now() - t0;
+	pingpong.done = 1;
+	while (pingpong.running > 0)
+		Cond_Wait(&pingpong.mx, &pingpong.exited);
+	Mutex_Unlock(&pingpong.mx);
+
+	printf("%ld rounds (work %d) with %d hogs in %.3f sec: %.2f usec/round\n",
+		pingpong.rounds, pingpong.work, pingpong.hogs, dt, 1E6 * dt / pingpong.rounds);
+	return 0;
+}
+
+static int bench_pingpong(int argc, const char** argv)
+{
+	pingpong.rounds = (argc > 0) ? atol(argv[0]) : 10000;
+	pingpong.hogs = (argc > 1) ? atoi(argv[1]) : 0;
+	pingpong.work = (argc > 2) ? atoi(argv[2]) : 0;
+	int fair = (argc > 3) && strcmp(argv[3], "fair") == 0;
+	if (pingpong.rounds < 1 || pingpong.hogs < 0 || pingpong.work < 0 || pingpong.work > 40) {
+		fprintf(stderr, "pingpong: bad arguments\n");
+		return 1;
+	}
+	pingpong.turn = 0;
+	pingpong.done = 0;
+	pingpong.mx = MUTEX_INIT;
+	pingpong.cv[0] = pingpong.cv[1] = pingpong.exited = COND_INIT;
+
+	sched_policy_t old = set_sched_policy(fair ? SCHED_POLICY_FAIR : SCHED_POLICY_MLFQ);
+	boot(1, 0, pingpong_boot, 0, NULL);
+	set_sched_policy(old);
+	return 0;
+}
+
+
+/*
+	broadcast [threads] [rounds] [work] [cores]
+
+	A thread wakes up a number of waiting threads with Cond_Broadcast, 
+	computes fibo(work) while still holding the mutex, and waits until all 
+	of them have seen the broadcast, for a number of rounds. The woken 
+	threads must all lock the mutex, one at a time. Report the time and the 
+	context switches per round. 
+	Build with -DCV_MORPHING=0 to compare against waking up all the waiters 
+	at once.
+ */
+
+static struct {
+	int N;
+	long rounds;
+	int work;
+	long round; /* The current round */
+	int seen; /* The threads that have seen the current round */
+	int running;
+	Mutex mx;
+	CondVar go, seen_all, exited;
+} bcast;
+
+static int broadcast_waiter(int i, void* args)
+{
+	Mutex_Lock(&bcast.mx);
+	for (long r = 1; r <= bcast.rounds; r++) {
+		while (bcast.round < r)
+			Cond_Wait(&bcast.mx, &bcast.go);
+		if (++bcast.seen == bcast.N)
+			Cond_Signal(&bcast.seen_all);
+	}
+	bcast.running--;
+	Cond_Signal(&bcast.exited);
+	Mutex_Unlock(&bcast.mx);
+	return 0;
+}
+
+static int broadcast_boot(int argl, void* args)
+{
+	bcast.running = bcast.N;
+	for (int i = 0; i < bcast.N; i++)
+		CreateThread(broadcast_waiter, i, NULL);
+
+	unsigned long sw0 = context_switches();
+	double t0 = now();
+	Mutex_Lock(&bcast.mx);
+	for (long r = 1; r <= bcast.rounds; r++) {
+		bcast.seen = 0;
+		bcast.round = r;
+		Cond_Broadcast(&bcast.go);
+		if (bcast.work > 0)
+			fibo(bcast.work);
+		while (bcast.seen < bcast.N)
+			Cond_Wait(&bcast.mx, &bcast.seen_all);
+	}
+	double dt = now() - t0;
+	unsigned long sw = context_switches() - sw0;
+
+	while (bcast.running > 0)
+		Cond_Wait(&bcast.mx, &bcast.exited);
+	Mutex_Unlock(&bcast.mx);
+
+	printf("%ld broadcasts to %d threads in %.3f sec: %.2f usec/broadcast, %.1f switches/broadcast\n",
+		bcast.rounds, bcast.N, dt, 1E6 * dt / bcast.rounds, (double) sw / bcast.rounds);
+	return 0;
+}
+
+static int bench_broadcast(int argc, const char** argv)
+{
+	bcast.N = (argc > 0) ? atoi(argv[0]) : 16;
+	bcast.rounds = (argc > 1) ? atol(argv[1]) : 10000;
+	bcast.work = (argc > 2) ? atoi(argv[2]) : 0;
+	int ncores = (argc > 3) ? atoi(argv[3]) : 4;
+	if (bcast.N < 1 || bcast.rounds < 1 || bcast.work < 0 || bcast.work > 40 
+		|| ncores < 1 || ncores > MAX_CORES) {
+		fprintf(stderr, "broadcast: bad arguments\n");
+		return 1;
+	}
+	bcast.round = 0;
+	bcast.mx = MUTEX_INIT;
+	bcast.go = bcast.seen_all = bcast.exited = COND_INIT;
+
+	boot(ncores, 0, broadcast_boot, 0, NULL);
+	return 0;
+}
+
+
+/*
+	mutex [threads] [iterations] [work] [cores]
+
+	A number of threads lock a mutex for a number of iterations, and 
+	compute fibo(work) while holding it. Report the time per iteration
+	and the context switches. Threads that
+	find the mutex locked spin for a while and then sleep, and they are 
+	woken up one at a time as it is unlocked.
+ */
+
+static struct {
+	int N;
+	long iterations;
+	int work;
+	int running;
+	Mutex mx;
+	Mutex exit_mx;
+	CondVar exited;
+} mxbench;
+
+static int mutex_thread(int argl, void* args)
+{
+	for (long i = 0; i < mxbench.iterations; i++) {
+		Mutex_Lock(&mxbench.mx);
+		if (mxbench.work > 0)
+			fibo(mxbench.work);
+		Mutex_Unlock(&mxbench.mx);
+	}
+	Mutex_Lock(&mxbench.exit_mx);
+	mxbench.running--;
+	Cond_Signal(&mxbench.exited);
+	Mutex_Unlock(&mxbench.exit_mx);
+	return 0;
+}
+
+static int mutex_boot(int argl, void* args)
+{
+	mxbench.running = mxbench.N;
+	unsigned long sw0 = context_switches();
+	double t0 = now();
+	for (int i = 0; i < mxbench.N; i++)
+		CreateThread(mutex_thread, i, NULL);
+
+	Mutex_Lock(&mxbench.exit_mx);
+	while (mxbench.running > 0)
+		Cond_Wait(&mxbench.exit_mx, &mxbench.exited);
+	Mutex_Unlock(&mxbench.exit_mx);
+	double dt = now() - t0;
+	unsigned long sw = context_switches() - sw0;
+
+	long total = mxbench.N * mxbench.iterations;
+	printf("%ld iterations (work %d) by %d threads in %.3f sec: %.2f usec/iteration, %lu switches\n",
+		total, mxbench.work, mxbench.N, dt, 1E6 * dt / total, sw);
+	return 0;
+}
+
+static int bench_mutex(int argc, const char** argv)
+{
+	mxbench.N = (argc > 0) ? atoi(argv[0]) : 8;
+	mxbench.iterations = (argc > 1) ? atol(argv[1]) : 1000;
+	mxbench.work = (argc > 2) ? atoi(argv[2]) : 10;
+	int ncores = (argc > 3) ? atoi(argv[3]) : 4;
+	if (mxbench.N < 1 || mxbench.iterations < 1 || mxbench.work < 0 || mxbench.work > 40 
+		|| ncores < 1 || ncores > MAX_CORES) {
+		fprintf(stderr, "mutex: bad arguments\n");
+		return 1;
+	}
+	mxbench.mx = mxbench.exit_mx = MUTEX_INIT;
+	mxbench.exited = COND_INIT;
+
+	boot(ncores, 0, mutex_boot, 0, NULL);
+	return 0;
+}
+
+
+/*
+	syscalls [threads] [calls] [cores] [io|getpid]
+
+	A number of threads make system calls which do not depend on each other. 
+	Report the rate of system calls for 1 core and for the given cores.
+	With "io", the calls are Write and Read on a null device of each thread; 
+	they do not take the kernel lock, so they should scale with the cores.
+	With "getpid", the calls are GetPid, which takes no lock, while another 
+	thread keeps making Exec and WaitChild calls, which hold the kernel lock.
+ */
+
+static struct {
+	int N;
+	long calls;
+	int getpid;
+	volatile int done;
+	int running;
+	Mutex mx;
+	CondVar exited;
+} sysbench;
+
+static int syscalls_child(int argl, void* args)
+{
+	return 0;
+}
+
+static int syscalls_heavy(int argl, void* args)
+{
+	while (!sysbench.done)
+		WaitChild(Exec(syscalls_child, 0, NULL), NULL);
+
+	Mutex_Lock(&sysbench.mx);
+	sysbench.running--;
+	Cond_Signal(&sysbench.exited);
+	Mutex_Unlock(&sysbench.mx);
+	return 0;
+}
+
+static int syscalls_thread(int argl, void* args)
+{
+	if (sysbench.getpid) {
+		for (long i = 0; i < sysbench.calls; i++)
+			GetPid();
+	} else {
+		char buf[64];
+		Fid_t fid = OpenNull();
+		for (long i = 0; i < sysbench.calls; i += 2) {
+			Write(fid, buf, sizeof(buf));
+			Read(fid, buf, sizeof(buf));
+		}
+		Close(fid);
+	}
+
+	Mutex_Lock(&sysbench.mx);
+	sysbench.running--;
+	Cond_Signal(&sysbench.exited);
+	Mutex_Unlock(&sysbench.mx);
+	return 0;
+}
+
+static int syscalls_boot(int argl, void* args)
+{
+	/* The heavy thread, if any, counts as running until it sees done */
+	sysbench.running = sysbench.N + sysbench.getpid;
+	sysbench.done = 0;
+	if (sysbench.getpid)
+		CreateThread(syscalls_heavy, 0, NULL);
+
+	unsigned long sw0 = context_switches();
+	double t0 = now();
+	for (int i = 0; i < sysbench.N; i++)
+		CreateThread(syscalls_thread, i, NULL);
+
+	Mutex_Lock(&sysbench.mx);
+	while (sysbench.running > sysbench.getpid)
+		Cond_Wait(&sysbench.mx, &sysbench.exited);
+	double dt = now() - t0;
+	unsigned long sw = context_switches() - sw0;
+
+	/* Do not leave the heavy thread reaping children while we exit */
+	sysbench.done = 1;
+	while (sysbench.running > 0)
+		Cond_Wait(&sysbench.mx, &sysbench.exited);
+	Mutex_Unlock(&sysbench.mx);
+
+	long total = sysbench.N * sysbench.calls;
+	printf("%2d cores: %ld calls by %d threads in %.3f sec: %.0f calls/sec, %lu switches\n",
+		argl, total, sysbench.N, dt, total / dt, sw);
+	return 0;
+}
+
+static int bench_syscalls(int argc, const char** argv)
+{
+	sysbench.N = (argc > 0) ? atoi(argv[0]) : 4;
+	sysbench.calls = (argc > 1) ? atol(argv[1]) : 1000000;
+	int ncores = (argc > 2) ? atoi(argv[2]) : 4;
+	sysbench.getpid = (argc > 3) && strcmp(argv[3], "getpid") == 0;
+	if (sysbench.N < 1 || sysbench.calls < 1 || ncores < 1 || ncores > MAX_CORES) {
+		fprintf(stderr, "syscalls: bad arguments\n");
+		return 1;
+	}
+	sysbench.mx = MUTEX_INIT;
+	sysbench.exited = COND_INIT;
+
+	boot(1, 0, syscalls_boot, 1, NULL);
+	if (ncores > 1)
+		boot(ncores, 0, syscalls_boot, ncores, NULL);
+	return 0;
+}
+
+
+/*
+	threads [threads] [rounds] [cores]
+
+	A number of threads create and join short-lived threads, one at a 
+	time. Report the rate of thread creations (each with its join).
+ */
+
+static struct {
+	int N;
+	long rounds;
+} thrbench;
+
+static int threads_child(int argl, void* args)
+{
+	return argl;
+}
+
+static int threads_thread(int argl, void* args)
+{
+	for (long i = 0; i < thrbench.rounds; i++) {
+		int exitval;
+		ThreadJoin(CreateThread(threads_child, argl, NULL), &exitval);
+		assert(exitval == argl);
+	}
+	return 0;
+}
+
+static int threads_boot(int argl, void* args)
+{
+	Tid_t tids[thrbench.N];
+	double t0 = now();
+	for (int i = 0; i < thrbench.N; i++)
+		tids[i] = CreateThread(threads_thread, i, NULL);
+	for (int i = 0; i < thrbench.N; i++)
+		ThreadJoin(tids[i], NULL);
+	double dt = now() - t0;
+
+	long total = thrbench.N * thrbench.rounds;
+	printf("%2d cores: %ld threads created and joined by %d threads in %.3f sec: %.2f usec/thread\n",
+		argl, total, thrbench.N, dt, 1E6 * dt / total);
+	return 0;
+}
+
+static int bench_threads(int argc, const char** argv)
+{
+	thrbench.N = (argc > 0) ? atoi(argv[0]) : 4;
+	thrbench.rounds = (argc > 1) ? atol(argv[1]) : 10000;
+	int ncores = (argc > 2) ? atoi(argv[2]) : 4;
+	if (thrbench.N < 1 || thrbench.N > 1000 || thrbench.rounds < 1 || ncores < 1 || ncores > MAX_CORES) {
+		fprintf(stderr, "threads: bad arguments\n");
+		return 1;
+	}
+
+	boot(ncores, 0, threads_boot, ncores, NULL);
+	return 0;
+}
+
+
+/****************************************************/
+
+struct benchmark {
+	const char* name;
+	int (*func)(int argc, const char** argv);
+	const char* help;
+};
+
+static struct benchmark BENCHMARKS[] = {
+	{ "switch", bench_switch, "switch [count]: rate of BIOS context switches" },
+	{ "fairness", bench_fairness, 
+	  "fairness [philosophers] [bites] [hogs] [cores]: compare the scheduling policies" },
+	{ "pingpong", bench_pingpong, "pingpong [rounds] [hogs] [work] [mlfq|fair]: latency of condition variable handoffs" },
+	{ "broadcast", bench_broadcast, "broadcast [threads] [rounds] [work] [cores]: cost of waking up many threads" },
+	{ "mutex", bench_mutex, "mutex [threads] [iterations] [work] [cores]: throughput of a contended mutex" },
+	{ "syscalls", bench_syscalls, "syscalls [threads] [calls] [cores] [io|getpid]: scaling of independent system calls" },
+	{ "threads", bench_threads, "threads [threads] [rounds] [cores]: rate of thread creation and join" },
+	{ NULL, NULL, NULL }
+};
+
+static void usage(const char* pname)
+{
+	printf("usage:\n  %s <benchmark> <args...>\n\nwhere <benchmark> is one of:\n", pname);
+	for (struct benchmark* b = BENCHMARKS; b->name; b++)
+		printf("  %s\n", b->help);
+	exit(1);
+}
+
+int main(int argc, const char** argv)
+{
+	if (argc < 2)
+		usage(argv[0]);
+
+	for (struct benchmark* b = BENCHMARKS; b->name; b++)
+		if (strcmp(b->name, argv[1]) == 0)
+			return b->func(argc - 2, argv + 2);
+
+	usage(argv[0]);
+	return 1;
+}
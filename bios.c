@@ -9,6 +9,8 @@
 #include <sys/stat.h>
 #include <sys/select.h>
 #include <sys/signalfd.h>
+#include <sys/sysinfo.h>
+#include <sched.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
@@ -78,6 +80,9 @@ static Core CORE[MAX_CORES];
 /* Number of cores */
 static unsigned int ncores = 0;
 
+/* If set, core threads are pinned to host cpus */
+static int pin_cores = 0;
+
 /* Core barrier */
 static pthread_barrier_t system_barrier, core_barrier;
 
@@ -684,8 +689,17 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 			CORE[c].irq_raised[intno] = 0;
 		}
 
-		/* Create the core thread */
-		CHECKRC(pthread_create(& CORE[c].thread, NULL, bootfunc_wrapper, &CORE[c]));
+		/* Create the core thread, possibly pinned to a host cpu */
+		pthread_attr_t attr;
+		CHECKRC(pthread_attr_init(&attr));
+		if(pin_cores) {
+			cpu_set_t cpuset;
+			CPU_ZERO(&cpuset);
+			CPU_SET(c % get_nprocs(), &cpuset);
+			CHECKRC(pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset));
+		}
+		CHECKRC(pthread_create(& CORE[c].thread, &attr, bootfunc_wrapper, &CORE[c]));
+		CHECKRC(pthread_attr_destroy(&attr));
 		char thread_name[16];
 		CHECK(snprintf(thread_name,16,"core-%d",c));
 		CHECKRC(pthread_setname_np(CORE[c].thread, thread_name));
@@ -712,8 +726,8 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 	/* Delete the Core table */
 	ncores = 0;
 
-	/* emit statistics */
-#if 0
+	/* emit statistics (build with -DVM_STATS) */
+#ifdef VM_STATS
 	fprintf(stderr,"PIC loops: %lu  queued/drained= %lu / %lu\n", 
 		PIC_loops, PIC_usr1_queued, PIC_usr1_drained);
 	for(uint c=0;c<cores;c++) {
@@ -727,6 +741,13 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 }
 
 
+void vm_pin_cores(int pin)
+{
+	CHECK_CONDITION(ncores==0);
+	pin_cores = pin;
+}
+
+
 uint cpu_cores()
 {
 	return ncores;
@@ -734,19 +755,28 @@ uint cpu_cores()
 
 void cpu_core_halt()
 {
-	/* unmask signals and call sigsuspend */
+	/* block SIGUSR1 (if not already blocked) and wait on the halt condition */
 	Core* core = curr_core();
-	assert(! core->int_disabled);
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
+	int disabled = core->int_disabled;
+	if(! disabled)
+		CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
 	pthread_mutex_lock(& core_halt_mutex);
-	core->halted = 1;
-	rlist_push_front(&halted_list, & core->halted_node);
-	while(core->halted)
-		pthread_cond_wait(& core->halt_cond, & core_halt_mutex);
+	/* Do not halt if an interrupt was raised after the last dispatch */
+	int pending = 0;
+	for(uint intno=0; intno<maximum_interrupt_no; intno++)
+		pending |= core->intpending[intno];
+	if(! pending) {
+		core->halted = 1;
+		rlist_push_front(&halted_list, & core->halted_node);
+		while(core->halted)
+			pthread_cond_wait(& core->halt_cond, & core_halt_mutex);
+	}
 	assert(! core->halted);
 	pthread_mutex_unlock(& core_halt_mutex);
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
-	dispatch_interrupts(core);
+	if(! disabled) {
+		CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+		dispatch_interrupts(core);
+	}
 }
 
 static inline void core_restart(Core* core)
@@ -819,6 +849,94 @@ void cpu_enable_interrupts()
 }
 
 
+#ifdef ASM_CONTEXT_SWITCH
+
+/*
+	The context switch.
+
+	The callee-saved registers (rbp, rbx, r12-r15), and the control words of the
+	SSE and x87 units, are pushed on the current stack, the stack pointer is 
+	saved into oldctx, and the stack pointer of newctx is loaded. Then, the
+	registers of the new context are popped, and we return into it.
+
+	Unlike swapcontext(), no system call is made, since the signal mask is not 
+	saved.
+ */
+__asm__(
+	".text\n"
+	".globl cpu_swap_context\n"
+	".type cpu_swap_context, @function\n"
+	"cpu_swap_context:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq (%rsi), %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size cpu_swap_context, .-cpu_swap_context\n"
+);
+
+/*
+	A new context 'returns' into this trampoline from cpu_swap_context(), 
+	with the function to execute in r12. The function must never return.
+ */
+void cpu_context_trampoline();
+__asm__(
+	".text\n"
+	".type cpu_context_trampoline, @function\n"
+	"cpu_context_trampoline:\n"
+	"	call *%r12\n"
+	"	call abort@PLT\n"
+	".size cpu_context_trampoline, .-cpu_context_trampoline\n"
+);
+
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* The top of the stack, aligned to 16 bytes as required by the ABI */
+	uintptr_t top = ((uintptr_t) ss_sp + ss_size) & ~ (uintptr_t) 15;
+
+	/* 
+		Build the frame popped by cpu_swap_context(). After the final 'ret', 
+		the stack pointer is 16-byte aligned, so that the 'call' in the 
+		trampoline enters ctx_func with a correctly aligned stack.
+	 */
+	uint64_t* frame = (uint64_t*) top;
+	*--frame = (uint64_t) cpu_context_trampoline;	/* return address */
+	*--frame = 0;							/* rbp */
+	*--frame = 0;							/* rbx */
+	*--frame = (uint64_t) ctx_func;			/* r12 */
+	*--frame = 0;							/* r13 */
+	*--frame = 0;							/* r14 */
+	*--frame = 0;							/* r15 */
+
+	/* The current SSE and x87 control words */
+	uint32_t mxcsr; 
+	uint16_t fpucw;
+	__asm__ volatile("stmxcsr %0" : "=m"(mxcsr));
+	__asm__ volatile("fnstcw %0" : "=m"(fpucw));
+	*--frame = ((uint64_t) fpucw << 32) | mxcsr;
+
+	ctx->sp = frame;
+}
+
+#else
+
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
@@ -840,6 +958,7 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#endif
 
 
 /*
@@ -878,6 +997,14 @@ TimerDuration bios_clock()
 }	
 
 
+TimerDuration bios_clock_hires()
+{
+	struct timespec t;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &t));
+	return 1000000ul * t.tv_sec + t.tv_nsec / 1000ul;
+}
+
+
 
 uint bios_serial_ports()
 {
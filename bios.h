@@ -161,6 +161,21 @@ typedef enum Interrupt
 void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno);
 
 
+/**
+	@brief Pin the simulated cores to host cpus.
+
+	If @c pin is non-zero, the next call to @c vm_boot() will pin the thread 
+	simulating core @f$ c @f$ to host cpu @f$ c \bmod n @f$, where @f$ n @f$ is
+	the number of host cpus. This keeps the caches of each core warm.
+	By default, the simulated cores are not pinned.
+
+	This function must not be called while the VM is running.
+
+	@param pin non-zero to enable pinning, zero to disable it
+ */
+void vm_pin_cores(int pin);
+
+
 /**
 	@brief Contains the id of the current core.
  */
@@ -237,6 +252,12 @@ void cpu_enable_interrupts();
 
 	This function is useful when a core becomes idle. An idle core does not
 	consume simulation resources (in particular CPU time).
+
+	If an interrupt has been raised but not yet delivered (e.g., because 
+	interrupts are disabled), the core does not halt. Thus, a core can check
+	for work with interrupts disabled and then halt, without missing
+	an interrupt raised in between. If interrupts are disabled, they remain
+	disabled (and pending) when this call returns.
 */
 void cpu_core_halt();
 
@@ -264,11 +285,36 @@ void cpu_core_restart_one();
 void cpu_core_restart_all();
 
 
+/*
+	On x86-64, the context switch is hand-written in assembly, and only saves
+	the registers that are preserved across function calls. Build with 
+	-DUCONTEXT_SWITCH to use the (slower) ucontext-based switch instead. 
+ */
+#if defined(__x86_64__) && !defined(UCONTEXT_SWITCH)
+#define ASM_CONTEXT_SWITCH
+#endif
+
+#ifdef ASM_CONTEXT_SWITCH
+
+/**
+	@brief A type for saving CPU context into.
+
+	The callee-saved registers are pushed on the thread's stack, so the
+	context is just the saved stack pointer.
+*/
+typedef struct cpu_context {
+	void* sp;	/**< @brief The saved stack pointer */
+} cpu_context_t;
+
+#else
+
 /**
 	@brief A type for saving CPU context into.
 */
 typedef ucontext_t cpu_context_t;
 
+#endif
+
 
 /**
 	@brief Initialize a CPU context for a new thread.
@@ -289,6 +335,9 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
 	Save the current context into @c oldctx and load the contents of @c newctx
 	into the CPU.
 
+	Note that the signal mask is not part of the context. Therefore, interrupts
+	stay disabled or enabled across the switch, as set by the caller.
+
 	@param oldctx pointer to the storage for the old context
 	@param newctx pointer to the new context to be loaded
 */
@@ -343,6 +392,19 @@ TimerDuration bios_cancel_timer();
 TimerDuration bios_clock();
 
 
+/**
+	@brief Get the current time from a high-resolution clock.
+
+	This function returns the value of a monotonic clock, in usec,
+	with a resolution of 1 usec. Unlike @c bios_clock(), it is 
+	appropriate for measuring short intervals, but it is also more 
+	expensive to read.
+
+	@see bios_clock
+ */
+TimerDuration bios_clock_hires();
+
+
 
 
 /**
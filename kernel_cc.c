@@ -1,6 +1,7 @@
 
 
 #include <assert.h>
+#include <string.h>
 
 #include "kernel_sched.h"
 #include "kernel_proc.h"
@@ -24,7 +25,9 @@
  	-------------------------
 
  	This mutex will act as a spinlock if preemption is off, and a
- 	yielding mutex if preemption is on.
+ 	sleeping mutex if preemption is on: after spinning for a while, 
+ 	the thread sleeps in a FIFO queue of the kernel, and unlocking the
+ 	mutex wakes up exactly one sleeping thread.
 
  	Therefore, we can call the same function from both the preemptive and
  	the non-preemptive domain of the kernel.
@@ -32,30 +35,516 @@
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
  */
-void Mutex_Lock(Mutex* lock)
+
+/* 
+	The values of a mutex. A locked mutex holds the serial number of the thread
+	which locked it (the owner), shifted by MUTEX_OWNER_SHIFT, with bit MUTEX_LOCKED
+	set. Unlike its TCB, the serial number of a thread is never reused (see
+	kernel_sched.c). Bit MUTEX_CONTENDED is also set when threads may be sleeping
+	in the wait table for it (see below), in which case unlocking it must wake 
+	one of them up.
+
+	Bit MUTEX_COUNTED is set when the mutex was locked in the preemptive domain.
+	Such a mutex is counted in @c locks_held of its owner until it is unlocked,
+	and a thread which holds locks is not throttled by its CPU quota (see yield).
+	Spinlocks (locked with preemption off) are not counted: a thread is never
+	preempted while it holds one.
+ */
+#define MUTEX_UNLOCKED 0
+#define MUTEX_LOCKED 1
+#define MUTEX_CONTENDED 2
+#define MUTEX_COUNTED 4
+#define MUTEX_OWNER_SHIFT 3
+
+/* The value of a mutex locked by the current thread */
+static inline Mutex mutex_owned()
+{
+  Mutex val = ((Mutex) CURTHREAD->serial << MUTEX_OWNER_SHIFT) | MUTEX_LOCKED;
+  return get_core_preemption() ? val | MUTEX_COUNTED : val;
+}
+
+/* The serial number of the owner of a mutex with the given value */
+static inline unsigned long mutex_owner(Mutex val)
+{
+  return val >> MUTEX_OWNER_SHIFT;
+}
+
+/* Count a mutex just locked by the current thread, with the given value */
+static inline void mutex_count(Mutex val)
+{
+  if(val & MUTEX_COUNTED)
+    __atomic_add_fetch(&CURTHREAD->locks_held, 1, __ATOMIC_RELAXED);
+}
+
+/* Stop counting a mutex just unlocked, which had the given value */
+static inline void mutex_uncount(Mutex val)
 {
+  if(! (val & MUTEX_COUNTED)) return;
+  if(mutex_owner(val) == CURTHREAD->serial)
+    __atomic_sub_fetch(&CURTHREAD->locks_held, 1, __ATOMIC_RELAXED);
+  else
+    sched_lock_released(mutex_owner(val));
+}
+
+static void mutex_wake(Mutex* lock, unsigned long owner); /* forward */
+static unsigned long mutex_lock_contended(Mutex* lock); /* forward */
+
+/* The number of times to spin for a mutex, before sleeping */
+#ifndef MUTEX_SPINS
 #define MUTEX_SPINS 1000
+#endif
 
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
-      __builtin_ia32_pause();      
-      if(spin>0) 
-      	spin--; 
-      else { 
-      	spin=MUTEX_SPINS; 
-      	if(get_core_preemption())
-      		yield(SCHED_MUTEX); 
-      }
+static inline int mutex_trylock(Mutex* lock)
+{
+  Mutex unlocked = MUTEX_UNLOCKED, val = mutex_owned();
+  if(! __atomic_compare_exchange_n(lock, &unlocked, val, 0,
+  			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return 0;
+  mutex_count(val);
+  return 1;
+}
+
+
+/*
+	Lock profiling.
+	---------------
+
+	When built with LOCK_PROFILE, each mutex gets a record in a table,
+	keyed by its address. The record is updated by the thread which
+	has just locked (or is about to unlock) the mutex, so the updates
+	need no synchronization, except for the insertion of the record.
+	Mutex_Lock is a macro that passes the call site (see tinyos.h), and
+	the first site to lock a mutex names it, unless it is given a name by
+	@c lock_profile_name.
+ */
+#ifdef LOCK_PROFILE
+
+#define LOCK_PROFILE_SIZE 8192
+
+/** \cond HELPER Helper structure for lock profiling. */
+typedef struct __lock_profile {
+	Mutex* lock;				/* the mutex, or NULL if the record is free */
+	const char* name;			/* the name given by lock_profile_name */
+	const char* site;			/* the first call site to lock the mutex */
+	unsigned long acquired;		/* number of times locked */
+	unsigned long contended;	/* times the first attempt failed */
+	unsigned long spins;		/* spin iterations */
+	unsigned long sleeps;		/* times a thread slept for the mutex */
+	TimerDuration hold;			/* total time held, in usec */
+	TimerDuration held_since;	/* when it was last locked */
+} __lock_profile;
+/** \endcond */
+
+static __lock_profile lock_profiles[LOCK_PROFILE_SIZE];
+static unsigned long lock_profile_dropped;
+
+/* Return the record of a mutex, inserting it if needed, or NULL if the table is full */
+static __lock_profile* lock_profile(Mutex* lock)
+{
+	uintptr_t h = ((uintptr_t) lock * 0x9E3779B97F4A7C15ul) >> 40;
+	for(int i=0; i<LOCK_PROFILE_SIZE; i++) {
+		__lock_profile* p = &lock_profiles[(h+i) % LOCK_PROFILE_SIZE];
+		Mutex* key = __atomic_load_n(&p->lock, __ATOMIC_ACQUIRE);
+		if(key == NULL && __atomic_compare_exchange_n(&p->lock, &key, lock, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return p;
+		if(key == lock) return p;
+	}
+	__atomic_add_fetch(&lock_profile_dropped, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void lock_profile_acquired(Mutex* lock, const char* site, 
+	unsigned long spins, unsigned long sleeps, int contended)
+{
+	__lock_profile* p = lock_profile(lock);
+	if(p == NULL) return;
+	if(p->site == NULL) p->site = site;
+	p->acquired++;
+	p->contended += contended;
+	p->spins += spins;
+	p->sleeps += sleeps;
+	p->held_since = bios_clock_hires();
+}
+
+static void lock_profile_released(Mutex* lock)
+{
+	__lock_profile* p = lock_profile(lock);
+	if(p != NULL && p->held_since)
+		p->hold += bios_clock_hires() - p->held_since;
+}
+
+void lock_profile_name(Mutex* lock, const char* name)
+{
+	__lock_profile* p = lock_profile(lock);
+	if(p != NULL) p->name = name;
+}
+
+static Mutex kernel_mutex;  /* see below */
+static void lock_profile_name_wait_table(); /* forward */
+
+void lock_profile_reset()
+{
+	memset(lock_profiles, 0, sizeof(lock_profiles));
+	lock_profile_dropped = 0;
+	lock_profile_name(&kernel_mutex, "kernel_mutex");
+	lock_profile_name_wait_table();
+}
+
+static int lock_profile_cmp(const void* a, const void* b)
+{
+	const __lock_profile *x = a, *y = b;
+	if(x->contended != y->contended) return (x->contended < y->contended) ? 1 : -1;
+	if(x->hold != y->hold) return (x->hold < y->hold) ? 1 : -1;
+	return (x->acquired < y->acquired) ? 1 : (x->acquired > y->acquired) ? -1 : 0;
+}
+
+void lock_profile_report(FILE* out, unsigned int maxlines)
+{
+	/* Sort a copy, leaving out the mutexes that were never locked */
+	__lock_profile* recs = xmalloc(sizeof(lock_profiles));
+	size_t n = 0;
+	for(int i=0; i<LOCK_PROFILE_SIZE; i++)
+		if(lock_profiles[i].acquired > 0)
+			recs[n++] = lock_profiles[i];
+	qsort(recs, n, sizeof(__lock_profile), lock_profile_cmp);
+
+	fprintf(out, "%-36s %14s %10s %10s %12s %10s %10s\n", "Lock", "address",
+		"acquired", "contended", "spins", "sleeps", "hold(ms)");
+	for(size_t i=0; i<n && i<maxlines; i++) {
+		__lock_profile* p = &recs[i];
+		fprintf(out, "%-36.36s %14p %10lu %10lu %12lu %10lu %10.1f\n",
+			p->name ? p->name : p->site ? p->site : "?", (void*) p->lock,
+			p->acquired, p->contended, p->spins, p->sleeps, p->hold / 1000.0);
+	}
+	if(n > maxlines)
+		fprintf(out, "... %zu more locks\n", n - maxlines);
+	if(lock_profile_dropped)
+		fprintf(out, "(%lu acquisitions of locks not profiled, the table is full)\n", 
+			lock_profile_dropped);
+	free(recs);
+}
+
+#define PROFILE(stmt) stmt
+
+#else
+
+#define PROFILE(stmt)
+
+#endif
+
+
+#ifdef LOCK_PROFILE
+/* For callers that do not use the Mutex_Lock macro */
+void (Mutex_Lock)(Mutex* lock)
+{
+  Mutex_Lock_at(lock, NULL);
+}
+
+void Mutex_Lock_at(Mutex* lock, const char* site)
+#else
+void Mutex_Lock(Mutex* lock)
+#endif
+{
+  if(mutex_trylock(lock)) {
+    PROFILE(lock_profile_acquired(lock, site, 0, 0, 0));
+    return;
+  }
+
+  /* Spin, in case the holder runs on another core and unlocks soon */
+  for(int spin=MUTEX_SPINS; spin>0; spin--) {
+    __builtin_ia32_pause();
+    if(__atomic_load_n(lock, __ATOMIC_RELAXED)==MUTEX_UNLOCKED && mutex_trylock(lock)) {
+      PROFILE(lock_profile_acquired(lock, site, MUTEX_SPINS-spin+1, 0, 1));
+      return;
     }
   }
-#undef MUTEX_SPINS
+
+  unsigned long spins = MUTEX_SPINS, sleeps = 0;
+  if(get_core_preemption())
+    sleeps = mutex_lock_contended(lock);
+  else
+    /* In the non-preemptive domain, we cannot sleep */
+    while(! mutex_trylock(lock))
+      while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+        __builtin_ia32_pause();
+        spins++;
+      }
+  PROFILE(lock_profile_acquired(lock, site, spins, sleeps, 1));
+  (void) spins; (void) sleeps;
 }
 
 
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+  PROFILE(lock_profile_released(lock));
+  Mutex val = __atomic_exchange_n(lock, MUTEX_UNLOCKED, __ATOMIC_RELEASE);
+  mutex_uncount(val);
+  if(val & MUTEX_CONTENDED)
+    mutex_wake(lock, mutex_owner(val));
+}
+
+
+/*
+	The wait table.
+	---------------
+
+	A @c Mutex is one word (owner and flags), with no room for a queue of 
+	waiting threads.
+	Instead, threads sleeping for a mutex are queued in a hash table, keyed 
+	by the address of the mutex. Each bucket of the table is protected by 
+	a spinlock (a Mutex which never becomes MUTEX_CONTENDED), taken with
+	preemption off.
+
+	A thread sleeps for a mutex only when the mutex is MUTEX_CONTENDED. 
+	Unlocking a contended mutex wakes up the first thread queued for it,
+	which then competes for the mutex again, setting it to MUTEX_CONTENDED
+	(because more threads may be queued).
+
+	A thread which goes to sleep for a mutex lends its priority to the owner
+	(see sched_boost), which gets back its own when the mutex is unlocked.
+	The owner recorded in the mutex may have exited (e.g., if it never
+	unlocked the mutex), so it is looked up by its serial number among the
+	live threads.
+ */
+
+#define WAIT_TABLE_SIZE 256
+
+/** \cond HELPER Helper structures for the wait table. */
+typedef struct __wait_bucket {
+	Mutex lock;					/* protects the queue */
+	rlnode queue;				/* the waiters of this bucket, in FIFO order */
+} __wait_bucket;
+
+typedef struct __mx_waiter {
+	rlnode node;				/* node in a wait table queue */
+	TCB* thread;				/* the waiting thread */
+	void* key;					/* the mutex or futex that the thread waits for */
+	int futex;					/* set if the key is a futex */
+	int queued;					/* set while in the queue */
+} __mx_waiter;
+/** \endcond */
+
+static __wait_bucket wait_table[WAIT_TABLE_SIZE];
+
+static void __attribute__((constructor)) initialize_wait_table()
+{
+	for(int i=0; i<WAIT_TABLE_SIZE; i++) {
+		wait_table[i].lock = MUTEX_INIT;
+		rlnode_init(&wait_table[i].queue, NULL);
+	}
+}
+
+#ifdef LOCK_PROFILE
+static void lock_profile_name_wait_table()
+{
+	for(int i=0; i<WAIT_TABLE_SIZE; i++)
+		lock_profile_name(&wait_table[i].lock, "wait_table");
+}
+#endif
+
+static inline __wait_bucket* wait_bucket(void* key)
+{
+	uintptr_t h = (uintptr_t) key;
+	h ^= h >> 12;
+	return &wait_table[(h ^ (h >> 6)) % WAIT_TABLE_SIZE];
+}
+
+/* 
+	Remove a waiter from the wait table, if it is still there. 
+	Only the waiting thread may call this. Once a waiter is out of the
+	queue, nobody else puts it back, so @c queued can be tested unlocked.
+ */
+static void mutex_unqueue(__mx_waiter* w)
+{
+	if(! __atomic_load_n(&w->queued, __ATOMIC_ACQUIRE)) return;
+
+	__wait_bucket* b = wait_bucket(w->key);
+	int preempt = preempt_off;
+	Mutex_Lock(&b->lock);
+	if(w->queued) {
+		rlist_remove(&w->node);
+		w->queued = 0;
+	}
+	Mutex_Unlock(&b->lock);
+	if(preempt) preempt_on;
+}
+
+/* 
+	Wake up the first thread queued for a mutex, if any. This is called by
+	the thread which unlocked the mutex, which was held by @c owner.
+ */
+static void mutex_wake(Mutex* lock, unsigned long owner)
+{
+	__wait_bucket* b = wait_bucket(lock);
+	int preempt = preempt_off;
+	Mutex_Lock(&b->lock);
+	for(rlnode* n = b->queue.next; n != &b->queue; n = n->next) {
+		__mx_waiter* w = n->obj;
+		if(w->key == lock && !w->futex) {
+			rlist_remove(&w->node);
+			w->queued = 0;
+			wakeup(w->thread);
+			break;
+		}
+	}
+	Mutex_Unlock(&b->lock);
+	if(preempt) preempt_on;
+
+	/* Any waiter which lent the owner its priority is in the queue by now */
+	sched_unboost(owner, lock);
+}
+
+/* 
+	Sleep in the wait table, as long as the mutex is contended. 
+	Returns when woken up by an unlock, or if the mutex is no longer contended.
+ */
+static void mutex_park(Mutex* lock)
+{
+	__mx_waiter w = { .thread = NULL, .key = lock, .futex = 0, .queued = 0 };
+	rlnode_init(&w.node, &w);
+	__wait_bucket* b = wait_bucket(lock);
+
+	int preempt = preempt_off;
+	w.thread = CURTHREAD;
+	Mutex_Lock(&b->lock);
+	Mutex val = __atomic_load_n(lock, __ATOMIC_RELAXED);
+	if(val & MUTEX_CONTENDED) {
+		unsigned long owner = mutex_owner(val);
+		if(owner != 0 && owner != w.thread->serial)
+			sched_boost(owner, w.thread->priority, lock);
+		rlist_push_back(&b->queue, &w.node);
+		w.queued = 1;
+		sleep_releasing(STOPPED, &b->lock, SCHED_MUTEX, NO_TIMEOUT);
+		/* We are out of the queue, unless we were woken up by someone else */
+		mutex_unqueue(&w);
+	} else
+		Mutex_Unlock(&b->lock);
+	if(preempt) preempt_on;
+}
+
+/* 
+	Lock a mutex, sleeping in the wait table while it is held. 
+	Returns the number of times the thread slept.
+ */
+static unsigned long mutex_lock_contended(Mutex* lock)
+{
+	unsigned long sleeps = 0;
+	Mutex val = __atomic_load_n(lock, __ATOMIC_RELAXED);
+	while(1) {
+		if(val == MUTEX_UNLOCKED) {
+			/* Others may be sleeping for it, so the mutex stays contended */
+			Mutex owned = mutex_owned();
+			if(__atomic_compare_exchange_n(lock, &val, owned | MUTEX_CONTENDED, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				mutex_count(owned);
+				return sleeps;
+			}
+		} else if(! (val & MUTEX_CONTENDED) && ! __atomic_compare_exchange_n(lock, &val, 
+				val | MUTEX_CONTENDED, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			/* The mutex changed, try again */
+		} else {
+			mutex_park(lock);
+			sleeps++;
+			val = __atomic_load_n(lock, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/*
+	Move a thread, which sleeps on a condition variable, to the queue of a 
+	mutex which is held, so that it is woken up when the mutex is unlocked. 
+	Returns 0 (and does nothing) if the mutex is not held.
+	Must be called with preemption off.
+ */
+static int mutex_requeue(__mx_waiter* w)
+{
+	int ret = 0;
+	Mutex* lock = w->key;
+	__wait_bucket* b = wait_bucket(lock);
+	Mutex_Lock(&b->lock);
+
+	/* Mark the mutex contended, unless it is unlocked */
+	Mutex val = __atomic_load_n(lock, __ATOMIC_RELAXED);
+	while(val != MUTEX_UNLOCKED && 
+		! __atomic_compare_exchange_n(lock, &val, val | MUTEX_CONTENDED, 0, 
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	if(val != MUTEX_UNLOCKED) {
+		rlist_push_back(&b->queue, &w->node);
+		w->queued = 1;
+		ret = 1;
+	}
+
+	Mutex_Unlock(&b->lock);
+	return ret;
+}
+
+
+/*
+	Futexes.
+	--------
+
+	A futex is an int of user memory. Threads waiting on it are queued in
+	the wait table, keyed by its address, as the threads waiting for a
+	mutex. The value of the futex is checked while holding the spinlock of
+	its bucket, so that a FutexWake which follows a change of the value
+	(and therefore takes the same spinlock) cannot be missed.
+ */
+
+int sys_FutexWait(int* addr, int expected, timeout_t timeout)
+{
+	__mx_waiter w = { .thread = NULL, .key = addr, .futex = 1, .queued = 0 };
+	rlnode_init(&w.node, &w);
+	__wait_bucket* b = wait_bucket(addr);
+	int ret = -1;
+
+	int preempt = preempt_off;
+	w.thread = CURTHREAD;
+	Mutex_Lock(&b->lock);
+	if(__atomic_load_n(addr, __ATOMIC_ACQUIRE) == expected) {
+		rlist_push_back(&b->queue, &w.node);
+		w.queued = 1;
+		/* We have to translate timeout from msec to usec */
+		sleep_releasing(STOPPED, &b->lock, SCHED_USER, 
+			((long)timeout < 0) ? NO_TIMEOUT : timeout*1000ul);
+		/* 
+			Only FutexWake takes us out of the queue. We check under the spinlock,
+			since we may have timed out, and FutexWake may still be waking us up.
+		 */
+		Mutex_Lock(&b->lock);
+		if(w.queued)
+			rlist_remove(&w.node);
+		else
+			ret = 0;
+		Mutex_Unlock(&b->lock);
+	} else
+		Mutex_Unlock(&b->lock);
+	if(preempt) preempt_on;
+
+	return ret;
+}
+
+int sys_FutexWake(int* addr, int n)
+{
+	int woken = 0;
+	__wait_bucket* b = wait_bucket(addr);
+	int preempt = preempt_off;
+	Mutex_Lock(&b->lock);
+	for(rlnode* p = b->queue.next; p != &b->queue && woken < n; ) {
+		__mx_waiter* w = p->obj;
+		p = p->next;
+		if(w->key == addr && w->futex) {
+			rlist_remove(&w->node);
+			w->queued = 0;
+			wakeup(w->thread);
+			woken++;
+		}
+	}
+	Mutex_Unlock(&b->lock);
+	if(preempt) preempt_on;
+
+	return woken;
 }
 
 
@@ -71,6 +560,9 @@ typedef struct __cv_waiter {
 	sig_atomic_t signalled;		/* this is set if the thread is signalled */
 	sig_atomic_t removed;		/* this is set if the waiter is removed 
 								   from the ring */
+	sig_atomic_t morphed;		/* set if the waiter was moved to the 
+								   wait table by a broadcast */
+	__mx_waiter mxw;			/* used to wait for the mutex, if morphed */
 } __cv_waiter;
 /** \endcond */
 
@@ -90,7 +582,6 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
 
 
 /** 
-   @internal
    @brief Wait on a condition variable, specifying the cause. 
 
 	This function is the basic implementation for the 'wait' operation on
@@ -116,12 +607,15 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
   @see Cond_Signal
   @see Cond_Broadcast
   */
-static int cv_wait(Mutex* mutex, CondVar* cv, 
+int cv_wait(Mutex* mutex, CondVar* cv, 
 		enum SCHED_CAUSE cause, TimerDuration timeout)
 {
-	__cv_waiter waiter = { .thread=CURTHREAD, .signalled = 0, .removed=0 };
+	__cv_waiter waiter = { .thread=CURTHREAD, .signalled = 0, .removed=0, .morphed=0,
+		.mxw = { .thread=CURTHREAD, .key=mutex, .futex=0, .queued=0 } };
 	rlnode_init(& waiter.node, &waiter);
+	rlnode_init(& waiter.mxw.node, &waiter.mxw);
 
+	PROFILE(lock_profile_name(&cv->waitset_lock, "waitset_lock"));
 	Mutex_Lock(&(cv->waitset_lock));
 	/* We just push the current thread to the back of the list */
 	if(cv->waitset) {
@@ -145,7 +639,12 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 	}
 	Mutex_Unlock(&(cv->waitset_lock));
 
-	Mutex_Lock(mutex);
+	if(waiter.morphed) {
+		/* We may have woken up early (e.g., by the timeout) */
+		mutex_unqueue(&waiter.mxw);
+		mutex_lock_contended(mutex);
+	} else
+		Mutex_Lock(mutex);
 	return waiter.signalled;
 }
 
@@ -155,15 +654,18 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
   Helper for Cond_Signal and Cond_Broadcast. This method 
   will actually find a waiter to signal, if one exists. 
   Else, it leaves the cv->waitset == NULL.
+
+  A signal (but not a broadcast) hands off the core to the
+  waiter, if the signaller blocks next.
  */
-static inline void cv_signal(CondVar* cv)
+static inline void cv_signal(CondVar* cv, int handoff)
 {
 	/* Wakeup first process in the waiters' queue, if it exists. */
 	while(cv->waitset) {
 		__cv_waiter* waiter = cv->waitset;
 		remove_from_ring(cv, waiter);
 		waiter->removed = 1;
-		if(wakeup(waiter->thread)) {
+		if(handoff ? wakeup_handoff(waiter->thread) : wakeup(waiter->thread)) {
 			waiter->signalled = 1;
 			return;
 		}
@@ -186,21 +688,214 @@ int Cond_TimedWait(Mutex* mutex, CondVar* cv, timeout_t timeout)
 
 void Cond_Signal(CondVar* cv)
 {
+  PROFILE(lock_profile_name(&cv->waitset_lock, "waitset_lock"));
   Mutex_Lock(&(cv->waitset_lock));
-  cv_signal(cv);
+  cv_signal(cv, 1);
   Mutex_Unlock(&(cv->waitset_lock));
 }
 
 
+/*
+	Wait morphing: the waiters of a broadcast will all have to lock the
+	mutex, one at a time, so the waiters are not woken up. Instead, if 
+	the mutex is held (typically by the broadcaster), they are moved to the 
+	wait table, and each one is woken up by the previous one's Mutex_Unlock.
+	This saves the context switches of waking up threads that would just 
+	block again on the mutex.
+ */
+#ifndef CV_MORPHING
+#define CV_MORPHING 1
+#endif
+
 void Cond_Broadcast(CondVar* cv)
 {
+  PROFILE(lock_profile_name(&cv->waitset_lock, "waitset_lock"));
   Mutex_Lock(&(cv->waitset_lock));
-  while(cv->waitset) cv_signal(cv);
+#if CV_MORPHING
+  int preempt = preempt_off;
+  while(cv->waitset) {
+  	__cv_waiter* waiter = cv->waitset;
+  	remove_from_ring(cv, waiter);
+  	waiter->removed = 1;
+  	waiter->signalled = 1;
+  	if(mutex_requeue(&waiter->mxw))
+  		waiter->morphed = 1;
+  	else
+  		wakeup(waiter->thread);
+  }
+  if(preempt) preempt_on;
+#else
+  while(cv->waitset) cv_signal(cv, 0);
+#endif
   Mutex_Unlock(&(cv->waitset_lock));
 }
 
 
 
+/*
+	Reader-writer locks.
+	--------------------
+
+	The @c state of the lock holds the number of readers, plus two flags:
+	RW_WRITER is set while a writer holds the lock, and RW_WAITERS is set
+	while threads sleep for it. When RW_WAITERS is clear, readers and writers
+	take and release the lock by an atomic operation on @c state only.
+
+	Otherwise, they go through the monitor of @c mx (all sleeping and
+	waking up happens there, and RW_WAITERS is only set or cleared there).
+	A writer which unlocks hands the lock directly to all the readers that
+	wait for it; the last of these readers to unlock wakes up a writer.
+ */
+
+#define RW_WRITER  (1 << 30)
+#define RW_WAITERS (1 << 29)
+
+/* The RW_WAITERS flag, as it must be when @c mx is released */
+static inline int rw_waiters(RWLock* rw)
+{
+	return (rw->rwaiting > 0 || rw->wwaiting > 0) ? RW_WAITERS : 0;
+}
+
+void RWLock_ReadLock(RWLock* rw)
+{
+	int s = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+	while(! (s & (RW_WRITER|RW_WAITERS)))
+		if(__atomic_compare_exchange_n(&rw->state, &s, s+1, 1,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+
+	Mutex_Lock(&rw->mx);
+	if(rw->wwaiting == 0) {
+		/* No writer waits; we can go in unless a writer holds the lock */
+		s = __atomic_fetch_or(&rw->state, RW_WAITERS, __ATOMIC_ACQUIRE);
+		if(! (s & RW_WRITER)) {
+			/* Other readers may still unlock, so the state is changed atomically */
+			__atomic_add_fetch(&rw->state, 1, __ATOMIC_RELAXED);
+			if(! rw_waiters(rw))
+				__atomic_and_fetch(&rw->state, ~RW_WAITERS, __ATOMIC_RELAXED);
+			Mutex_Unlock(&rw->mx);
+			return;
+		}
+	} else
+		__atomic_fetch_or(&rw->state, RW_WAITERS, __ATOMIC_RELAXED);
+
+	/* Wait to be let in (and counted) by a writer's unlock */
+	rw->rwaiting++;
+	unsigned int phase = rw->rphase;
+	while(rw->rphase == phase)
+		Cond_Wait(&rw->mx, &rw->readers);
+	Mutex_Unlock(&rw->mx);
+}
+
+void RWLock_ReadUnlock(RWLock* rw)
+{
+	int s = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+	while(s != (1 | RW_WAITERS))
+		if(__atomic_compare_exchange_n(&rw->state, &s, s-1, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+
+	/* 
+		The last reader to leave, while a writer waits, wakes it up. This is
+		done in the monitor, so that the lock is not touched after the writer 
+		gets it (the writer may destroy it).
+	 */
+	Mutex_Lock(&rw->mx);
+	if(__atomic_sub_fetch(&rw->state, 1, __ATOMIC_RELEASE) == RW_WAITERS)
+		Cond_Signal(&rw->writers);
+	Mutex_Unlock(&rw->mx);
+}
+
+void RWLock_WriteLock(RWLock* rw)
+{
+	int s = 0;
+	if(__atomic_compare_exchange_n(&rw->state, &s, RW_WRITER, 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	Mutex_Lock(&rw->mx);
+	rw->wwaiting++;
+	__atomic_fetch_or(&rw->state, RW_WAITERS, __ATOMIC_RELAXED);
+	while(1) {
+		/* Only readers without RW_WAITERS can change the state now */
+		s = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+		if((s & ~RW_WAITERS) == 0) {
+			rw->wwaiting--;
+			if(__atomic_compare_exchange_n(&rw->state, &s, RW_WRITER | rw_waiters(rw), 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				break;
+			rw->wwaiting++;
+		} else
+			Cond_Wait(&rw->mx, &rw->writers);
+	}
+	Mutex_Unlock(&rw->mx);
+}
+
+void RWLock_WriteUnlock(RWLock* rw)
+{
+	int s = RW_WRITER;
+	if(__atomic_compare_exchange_n(&rw->state, &s, 0, 0,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		return;
+
+	Mutex_Lock(&rw->mx);
+	if(rw->rwaiting > 0) {
+		/* Let in the waiting readers, before any other writer */
+		int readers = rw->rwaiting;
+		rw->rwaiting = 0;
+		rw->rphase++;
+		__atomic_store_n(&rw->state, readers | rw_waiters(rw), __ATOMIC_RELEASE);
+		Cond_Broadcast(&rw->readers);
+	} else {
+		__atomic_store_n(&rw->state, rw_waiters(rw), __ATOMIC_RELEASE);
+		Cond_Signal(&rw->writers);
+	}
+	Mutex_Unlock(&rw->mx);
+}
+
+
+/*
+	Semaphores.
+	-----------
+
+	When the count is negative, its absolute value is the number of threads
+	which are sleeping, or about to sleep, in @c Sem_Down. An @c Sem_Up which 
+	finds such a thread hands it a wakeup (in @c wakeups), in the monitor 
+	of @c mx. Thus, after a thread returns from @c Sem_Down, no other thread
+	touches the semaphore, and it can be destroyed.
+ */
+
+int Sem_TryDown(Semaphore* sem)
+{
+	int c = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+	while(c > 0)
+		if(__atomic_compare_exchange_n(&sem->count, &c, c-1, 1,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return 1;
+	return 0;
+}
+
+void Sem_Down(Semaphore* sem)
+{
+	if(__atomic_fetch_sub(&sem->count, 1, __ATOMIC_ACQUIRE) > 0) return;
+
+	Mutex_Lock(&sem->mx);
+	while(sem->wakeups == 0)
+		Cond_Wait(&sem->mx, &sem->cv);
+	sem->wakeups--;
+	Mutex_Unlock(&sem->mx);
+}
+
+void Sem_Up(Semaphore* sem)
+{
+	if(__atomic_fetch_add(&sem->count, 1, __ATOMIC_RELEASE) >= 0) return;
+
+	Mutex_Lock(&sem->mx);
+	sem->wakeups++;
+	Cond_Signal(&sem->cv);
+	Mutex_Unlock(&sem->mx);
+}
+
 
 
 /*
@@ -257,6 +952,8 @@ static CondVar kernel_sem_cv = COND_INIT;
 
 void kernel_lock()
 {
+	/* Counted first, so that the thread is never throttled while it holds the lock */
+	__atomic_add_fetch(&CURTHREAD->locks_held, 1, __ATOMIC_RELAXED);
 	Mutex_Lock(& kernel_mutex);
 	while(kernel_sem<=0) {
 		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
@@ -271,6 +968,7 @@ void kernel_unlock()
 	kernel_sem++;
 	Cond_Signal(&kernel_sem_cv);
 	Mutex_Unlock(& kernel_mutex);
+	__atomic_sub_fetch(&CURTHREAD->locks_held, 1, __ATOMIC_RELAXED);
 }
 
 int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
@@ -307,6 +1005,7 @@ void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
 	Mutex_Lock(& kernel_mutex);
 	kernel_sem++;
 	Cond_Signal(&kernel_sem_cv);
+	__atomic_sub_fetch(&CURTHREAD->locks_held, 1, __ATOMIC_RELAXED);
 	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
 }
 
@@ -38,6 +38,10 @@
 
 /**
 	@brief Lock the kernel.
+
+	The kernel lock protects the process table and the threads of 
+	processes. It is held by the system calls of the PROC lock class
+	(see kernel_sys.h); the I/O system calls do not take it.
  */
 void kernel_lock();
 
@@ -80,6 +84,48 @@ void kernel_broadcast(CondVar* cv);
 void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
 
 
+/**
+	@brief Wait on a condition variable, specifying the cause and a timeout.
+
+	This is @c Cond_TimedWait for kernel code that does its own locking,
+	such as device drivers, without the kernel lock.
+
+	@returns 1 if signalled, 0 if not
+  */
+int cv_wait(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, TimerDuration timeout);
+
+
+
+#ifdef LOCK_PROFILE
+
+/**
+	@brief Name a mutex in the lock profile.
+
+	In a build with @c LOCK_PROFILE, each mutex is profiled separately. 
+	Mutexes without a name are reported by the call site that first locked them.
+	In other builds, this does nothing.
+ */
+void lock_profile_name(Mutex* lock, const char* name);
+
+/**
+	@brief Clear the lock profile.
+ */
+void lock_profile_reset();
+
+/**
+	@brief Print the lock profile.
+
+	Print one line for each mutex locked since the last @c lock_profile_reset,
+	the most contended (and then the longest held) first, up to @c maxlines lines.
+ */
+void lock_profile_report(FILE* out, unsigned int maxlines);
+
+#else
+
+#define lock_profile_name(lock, name)
+
+#endif
+
 
 /** @brief Set the preemption status for the current thread.
 
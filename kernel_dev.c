@@ -66,10 +66,17 @@ static file_ops nulldev_fops = {
 void serial_rx_handler();
 void serial_tx_handler();
 
+/*
+  The serial devices are not protected by the kernel lock. Each one has
+  a spinlock (taken with preemption off, also by the interrupt handler),
+  which makes the check for input atomic with waiting for it, and a 
+  mutex which keeps concurrent writes from interleaving.
+ */
 typedef struct serial_device_control_block {
   uint devno;
   Mutex spinlock;
   CondVar rx_ready;
+  Mutex write_lock;
 } serial_dcb_t;
 
 serial_dcb_t serial_dcb[MAX_TERMINALS];
@@ -90,6 +97,9 @@ void serial_rx_handler()
    */
   for(int i=0;i<bios_serial_ports();i++) {
     serial_dcb_t* dcb = &serial_dcb[i];
+    /* A reader that found no input is now waiting on rx_ready */
+    Mutex_Lock(&dcb->spinlock);
+    Mutex_Unlock(&dcb->spinlock);
     Cond_Broadcast(&dcb->rx_ready);
   }
   if(pre) preempt_on;
@@ -103,6 +113,7 @@ int serial_read(void* dev, char *buf, unsigned int size)
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
   preempt_off;            /* Stop preemption */
+  Mutex_Lock(&dcb->spinlock);
 
   uint count =  0;
 
@@ -113,12 +124,13 @@ int serial_read(void* dev, char *buf, unsigned int size)
       count++;
     }
     else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
+      cv_wait(&dcb->spinlock, &dcb->rx_ready, SCHED_IO, NO_TIMEOUT);
     }
     else
       break;
   }
 
+  Mutex_Unlock(&dcb->spinlock);
   preempt_on;           /* Restart preemption */
 
   return count;
@@ -144,6 +156,7 @@ int serial_write(void* dev, const char* buf, unsigned int size)
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
   unsigned int count = 0;
+  Mutex_Lock(&dcb->write_lock);
   while(count < size) {
     int success = bios_write_serial(dcb->devno, buf[count] );
 
@@ -157,6 +170,7 @@ int serial_write(void* dev, const char* buf, unsigned int size)
     else
       break;
   }
+  Mutex_Unlock(&dcb->write_lock);
 
   return count;  
 }
@@ -211,6 +225,7 @@ void initialize_devices()
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
     serial_dcb[i].spinlock = MUTEX_INIT;
+    serial_dcb[i].write_lock = MUTEX_INIT;
   }
 
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
@@ -9,6 +9,7 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_cc.h"
 
 
 
@@ -35,10 +36,10 @@ void boot_tinyos_kernel()
 
   if(cpu_core_id==0) {
     /* Initialize the kenrel data structures */
+    initialize_scheduler();   /* first, the system calls below need CURTHREAD */
     initialize_processes();
     initialize_devices();
     initialize_files();
-    initialize_scheduler();
 
     /* The boot task is executed normally! */
     if(Exec(boot_rec.init_task, boot_rec.argl, boot_rec.args)!=1)
@@ -65,7 +66,30 @@ void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
   boot_rec.argl = argl;
   boot_rec.args = args;
 
+#ifdef LOCK_PROFILE
+  lock_profile_reset();
+#endif
+
   vm_boot(boot_tinyos_kernel, ncores, nterm);
+
+#ifdef LOCK_PROFILE
+  /* Report the most contended mutexes */
+  lock_profile_report(stderr, 20);
+#endif
+
+#ifdef VM_STATS
+  /* Emit kernel statistics */
+  for(uint c=0; c<ncores; c++) {
+    core_stats cs;
+    get_core_stats(c, &cs);
+    fprintf(stderr, "Core %3d: context switches=%lu (voluntary=%lu involuntary=%lu) steals=%lu"
+      " idle=%.3f sec timer ticks avoided=%lu\n", c, cs.switches, cs.voluntary, cs.involuntary, 
+      cs.steals, cs.idle_time / 1E6, cs.ticks_avoided);
+  }
+  unsigned long hits, misses;
+  thread_cache_stats(&hits, &misses);
+  fprintf(stderr, "Thread cache: hits=%lu misses=%lu\n", hits, misses);
+#endif
 }
 
 
@@ -0,0 +1,105 @@
+
+#include "kernel_pool.h"
+#include "kernel_cc.h"
+
+
+/* A free object is linked through its first word */
+typedef struct pool_obj {
+	struct pool_obj* next;
+} pool_obj;
+
+
+/* Take the cache of the current core, or return NULL if it is busy */
+static inline pool_cache* pool_cache_take(kernel_pool* pool)
+{
+	pool_cache* cache = &pool->cache[cpu_core_id];
+	return __atomic_exchange_n(&cache->busy, 1, __ATOMIC_ACQUIRE) ? NULL : cache;
+}
+
+static inline void pool_cache_give(pool_cache* cache)
+{
+	__atomic_store_n(&cache->busy, 0, __ATOMIC_RELEASE);
+}
+
+
+void* pool_alloc(kernel_pool* pool)
+{
+	pool_obj* obj = NULL;
+	pool_cache* cache = pool_cache_take(pool);
+
+	if (cache != NULL) {
+		/* Refill an empty cache from the depot. The size is read without locking, as a hint. */
+		if (cache->head == NULL && __atomic_load_n(&pool->depot_size, __ATOMIC_RELAXED) > 0) {
+			Mutex_Lock(&pool->depot_lock);
+			while (pool->depot != NULL && cache->size < POOL_CACHE_MAX / 2) {
+				pool_obj* o = pool->depot;
+				pool->depot = o->next;
+				pool->depot_size--;
+				o->next = cache->head;
+				cache->head = o;
+				cache->size++;
+			}
+			Mutex_Unlock(&pool->depot_lock);
+		}
+
+		obj = cache->head;
+		if (obj != NULL) {
+			cache->head = obj->next;
+			cache->size--;
+		}
+		pool_cache_give(cache);
+	}
+
+	return (obj != NULL) ? obj : xmalloc(pool->objsize);
+}
+
+
+/* Put a list of objects into the depot, and free those that do not fit */
+static void pool_depot_put(kernel_pool* pool, pool_obj* list)
+{
+	Mutex_Lock(&pool->depot_lock);
+	while (list != NULL) {
+		pool_obj* obj = list;
+		list = obj->next;
+		if (pool->depot_size < POOL_DEPOT_MAX) {
+			obj->next = pool->depot;
+			pool->depot = obj;
+			pool->depot_size++;
+		} else
+			free(obj);
+	}
+	Mutex_Unlock(&pool->depot_lock);
+}
+
+
+void pool_free(kernel_pool* pool, void* ptr)
+{
+	pool_obj* obj = ptr;
+	pool_cache* cache = pool_cache_take(pool);
+
+	if (cache == NULL) {
+		obj->next = NULL;
+		pool_depot_put(pool, obj);
+		return;
+	}
+
+	/* Spill half of a full cache to the depot */
+	pool_obj* spill = NULL;
+	if (cache->size == POOL_CACHE_MAX) {
+		while (cache->size > POOL_CACHE_MAX / 2) {
+			pool_obj* o = cache->head;
+			cache->head = o->next;
+			cache->size--;
+			o->next = spill;
+			spill = o;
+		}
+	}
+
+	obj->next = cache->head;
+	cache->head = obj;
+	cache->size++;
+	pool_cache_give(cache);
+
+	if (spill != NULL)
+		pool_depot_put(pool, spill);
+}
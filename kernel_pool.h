@@ -0,0 +1,92 @@
+#ifndef __KERNEL_POOL_H
+#define __KERNEL_POOL_H
+
+#include "bios.h"
+#include "tinyos.h"
+
+/**
+	@file kernel_pool.h
+	@brief Object pools for small kernel objects.
+
+	@defgroup pool Object pools.
+	@ingroup kernel
+	@brief Object pools for small kernel objects.
+
+	A pool recycles the memory of kernel objects of one type (e.g., PTCBs),
+	so that creating and destroying them does not go through the global
+	allocator. A freed object is kept in a small cache of the core that
+	freed it, where the next allocation on this core will find it. When a
+	core cache overflows, half of it is moved to the depot of the pool, from
+	which the core caches are refilled when they are empty. Only when the
+	depot is full (or empty) is memory actually freed (or allocated).
+
+	This is the scheme of the thread cache (see kernel_sched.c), for
+	objects of any type.
+
+	@{
+*/
+
+/** @brief The maximum number of objects in a core cache */
+#define POOL_CACHE_MAX 32
+
+/** @brief The maximum number of objects in the depot of a pool */
+#define POOL_DEPOT_MAX 1024
+
+/** @brief The free objects of a pool on a core.
+
+	Each cache takes a cache line of its own, so that the cores do not
+	contend for the lines of their neighbours' caches (false sharing).
+ */
+typedef struct pool_cache {
+	int busy;     /**< @brief Set while a thread uses the cache */
+	void* head;   /**< @brief The list of free objects, linked through their first word */
+	uint size;    /**< @brief The number of objects in the list */
+} __attribute__((aligned(64))) pool_cache;
+
+/**
+	@brief A pool of objects of the same size.
+
+	A core cache is taken by setting its @c busy flag atomically. This is
+	cheaper than turning preemption off (which costs two system calls of the
+	host); a thread preempted while it holds the cache may even finish on
+	another core. When the cache of the core is busy, the depot is used.
+	The depot is protected by @c depot_lock.
+ */
+typedef struct kernel_pool {
+	size_t objsize;                /**< @brief The size of the objects */
+	pool_cache cache[MAX_CORES];   /**< @brief The caches of the cores */
+	Mutex depot_lock;              /**< @brief Protects the depot */
+	void* depot;                   /**< @brief The list of free objects shared by the cores */
+	uint depot_size;               /**< @brief The number of objects in @c depot */
+} kernel_pool;
+
+/**
+	@brief Initializer for a pool of objects of a type.
+
+	For example, `static kernel_pool ptcb_pool = POOL_INIT(PTCB);`
+ */
+#define POOL_INIT(type) { .objsize = (sizeof(type) < sizeof(void*)) ? sizeof(void*) : sizeof(type), \
+	.depot_lock = MUTEX_INIT, .depot = NULL, .depot_size = 0 }
+
+/**
+	@brief Allocate an object from a pool.
+
+	The object is not initialized. If the pool has no free objects,
+	memory is allocated with @c xmalloc().
+
+	@param pool the pool
+	@returns the new object
+ */
+void* pool_alloc(kernel_pool* pool);
+
+/**
+	@brief Return an object to its pool.
+
+	@param pool the pool
+	@param obj an object returned by @c pool_alloc() for the same pool
+ */
+void pool_free(kernel_pool* pool, void* obj);
+
+/** @} */
+
+#endif
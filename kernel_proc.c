@@ -16,18 +16,33 @@
 
  */
 
-/* The process table */
-PCB PT[MAX_PROC];
+/* 
+  The process table. 
+
+  The PCBs are allocated in chunks of PT_CHUNK_SIZE, as they are needed. 
+  The chunk of a pid is found through the PT index. Chunks are only 
+  added (under the kernel lock), and never removed while the kernel runs,
+  so a PCB can be looked up without locking.
+ */
+#define PT_CHUNK_SIZE 256
+#define PT_CHUNKS ((MAX_PROC + PT_CHUNK_SIZE - 1) / PT_CHUNK_SIZE)
+
+static PCB* PT[PT_CHUNKS];
+static unsigned int pt_chunks;  /* The number of allocated chunks */
 unsigned int process_count;
 
 PCB* get_pcb(Pid_t pid)
 {
-  return PT[pid].pstate==FREE ? NULL : &PT[pid];
+  if(pid < 0 || pid >= MAX_PROC) return NULL;
+  PCB* chunk = __atomic_load_n(&PT[pid / PT_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+  if(chunk == NULL) return NULL;
+  PCB* pcb = &chunk[pid % PT_CHUNK_SIZE];
+  return pcb->pstate==FREE ? NULL : pcb;
 }
 
 Pid_t get_pid(PCB* pcb)
 {
-  return pcb==NULL ? NOPROC : pcb-PT;
+  return pcb==NULL ? NOPROC : pcb->pid;
 }
 
 /* Initialize a PCB */
@@ -37,10 +52,19 @@ static inline void initialize_PCB(PCB* pcb)
   pcb->argl = 0;
   pcb->args = NULL;
   pcb->thread_count = 0;
+  pcb->cpu_time = 0;
+  pcb->cpu_weight = CPU_WEIGHT_DEFAULT;
+  pcb->cpu_quota = 0;
+  pcb->quota_period = 0;
+  pcb->period_usage = 0;
+  pcb->runnable = 0;
 
   for(int i=0;i<MAX_FILEID;i++)
     pcb->FIDT[i] = NULL;
-  rlnode_init(&pcb->thread_list, NULL);
+  pcb->fidt_lock = MUTEX_INIT;
+  pcb->thread_table = NULL;
+  pcb->thread_slots = 0;
+  pcb->thread_free = -1;
   rlnode_init(& pcb->children_list, NULL);
   rlnode_init(& pcb->exited_list, NULL);
   rlnode_init(& pcb->children_node, pcb);
@@ -51,21 +75,40 @@ static inline void initialize_PCB(PCB* pcb)
 
 static PCB* pcb_freelist;
 
-void initialize_processes()
+/* 
+  Add a chunk to the process table, and its PCBs to the free list. 
+  Returns 0 if the table is full.
+ */
+static int grow_process_table()
 {
-  /* initialize the PCBs */
-  for(Pid_t p=0; p<MAX_PROC; p++) {
-    initialize_PCB(&PT[p]);
+  if(pt_chunks == PT_CHUNKS)
+    return 0;
+
+  PCB* chunk = xmalloc(PT_CHUNK_SIZE * sizeof(PCB));
+  Pid_t first = pt_chunks * PT_CHUNK_SIZE;
+
+  /* use the parent field to build a free list, lower pids first */
+  for(int i = PT_CHUNK_SIZE-1; i >= 0; i--) {
+    initialize_PCB(&chunk[i]);
+    chunk[i].pid = first + i;
+    chunk[i].parent = pcb_freelist;
+    pcb_freelist = &chunk[i];
   }
 
-  /* use the parent field to build a free list */
-  PCB* pcbiter;
-  pcb_freelist = NULL;
-  for(pcbiter = PT+MAX_PROC; pcbiter!=PT; ) {
-    --pcbiter;
-    pcbiter->parent = pcb_freelist;
-    pcb_freelist = pcbiter;
+  __atomic_store_n(&PT[pt_chunks], chunk, __ATOMIC_RELEASE);
+  pt_chunks++;
+  return 1;
+}
+
+void initialize_processes()
+{
+  /* Drop the table of a previous boot */
+  for(uint c=0; c<pt_chunks; c++) {
+    free(PT[c]);
+    PT[c] = NULL;
   }
+  pt_chunks = 0;
+  pcb_freelist = NULL;
 
   process_count = 0;
 
@@ -82,10 +125,19 @@ PCB* acquire_PCB()
 {
   PCB* pcb = NULL;
 
+  if(pcb_freelist == NULL)
+    grow_process_table();
+
   if(pcb_freelist != NULL) {
     pcb = pcb_freelist;
     pcb->pstate = ALIVE;
     pcb->thread_count = 0; //we initialize the amount of the threads into zero
+    pcb->cpu_time = 0;
+    pcb->wait_time = 0;
+    pcb->switches = 0;
+    pcb->sleeps = 0;
+    pcb->children_usage = (resource_usage) { 0 };
+    pcb->period_usage = 0;
     pcb_freelist = pcb_freelist->parent;
     process_count++; 
   }
@@ -144,6 +196,8 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     /* Processes with pid<=1 (the scheduler and the init process) 
        are parentless and are treated specially. */
     newproc->parent = NULL;
+    newproc->cpu_weight = CPU_WEIGHT_DEFAULT;
+    newproc->cpu_quota = 0;
   }
   else
   {
@@ -154,12 +208,20 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     newproc->parent = curproc;
     rlist_push_front(& curproc->children_list, & newproc->children_node);
 
-    /* Inherit file streams from parent */
+    /* Inherit the CPU share, so that a process cannot escape its quota by forking */
+    newproc->cpu_weight = curproc->cpu_weight;
+    newproc->cpu_quota = curproc->cpu_quota;
+
+    /* Inherit file streams from parent, except those still being opened */
+    Mutex_Lock(&curproc->fidt_lock);
     for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
-       if(newproc->FIDT[i])
-          FCB_incref(newproc->FIDT[i]);
+       FCB* fcb = curproc->FIDT[i];
+       if(fcb && !FCB_is_reserved(fcb)) {
+          newproc->FIDT[i] = fcb;
+          FCB_incref(fcb);
+       }
     }
+    Mutex_Unlock(&curproc->fidt_lock);
   }
 
 
@@ -185,20 +247,8 @@ Pid_t sys_Exec(Task call, int argl, void* args)
   
   if(call != NULL) {
 
-  	//Allocate a new ptcb
-  	PTCB* main_ptcb=xmalloc(sizeof(PTCB));
-  
-  	//Add the new ptcb to the thread list of the new process
-	rlnode_init(&main_ptcb->thread_list_node,main_ptcb);
-  	rlist_push_back(&newproc->thread_list,&main_ptcb->thread_list_node);
-  	
-
-  	//Initialize the values of the ptcb
-  	main_ptcb->exited = 0;
-  	main_ptcb->detached = 0;
-  	main_ptcb->ref_count = 0;
-  	main_ptcb->exit_cv = COND_INIT;
-	
+  	//Allocate a new ptcb, with a handle in the new process
+  	PTCB* main_ptcb = acquire_PTCB(newproc, call, argl, args);
 
   	//Increase the thread counter of the new process
 	newproc->thread_count++;
@@ -208,11 +258,6 @@ Pid_t sys_Exec(Task call, int argl, void* args)
      
     //...and add it to the ptcb
     main_ptcb->tcb->ptcb = main_ptcb;
-    
-  	//Pass arguments to the new process thread
-  	main_ptcb->task = (void*)call; 
-  	main_ptcb->argl = argl;
-  	main_ptcb->args = args;
   	
   	//Add the new allocated thread to the scheduler queue
     wakeup(main_ptcb->tcb);
@@ -232,9 +277,68 @@ Pid_t sys_GetPid()
 }
 
 
+/* 
+  This is a NOLOCK call: the parent changes when it exits, so it is
+  read atomically (see sys_ThreadExit).
+*/
 Pid_t sys_GetPPid()
 {
-  return get_pid(CURPROC->parent);
+  return get_pid(__atomic_load_n(&CURPROC->parent, __ATOMIC_RELAXED));
+}
+
+
+int sys_SetCpuShare(Pid_t pid, unsigned int weight, unsigned int quota)
+{
+  PCB* pcb = get_pcb(pid);
+  if(pcb == NULL || pcb->pstate != ALIVE || (pcb != CURPROC && pcb->parent != CURPROC))
+    return -1;
+  if(weight < 1 || weight > CPU_WEIGHT_MAX || quota > 100*cpu_cores())
+    return -1;
+
+  /* The quota is kept as the CPU time allowed per accounting period */
+  pcb->cpu_weight = weight;
+  pcb->cpu_quota = (TimerDuration)quota * SCHED_QUOTA_PERIOD / 100;
+  return 0;
+}
+
+
+/* The usage of a process, without its children */
+static void process_usage(PCB* pcb, resource_usage* usage)
+{
+  usage->run_time = __atomic_load_n(&pcb->cpu_time, __ATOMIC_RELAXED);
+  usage->wait_time = __atomic_load_n(&pcb->wait_time, __ATOMIC_RELAXED);
+  usage->switches = __atomic_load_n(&pcb->switches, __ATOMIC_RELAXED);
+  usage->sleeps = __atomic_load_n(&pcb->sleeps, __ATOMIC_RELAXED);
+}
+
+static void add_usage(resource_usage* to, resource_usage* from)
+{
+  to->run_time += from->run_time;
+  to->wait_time += from->wait_time;
+  to->switches += from->switches;
+  to->sleeps += from->sleeps;
+}
+
+int sys_GetRUsage(usage_who who, resource_usage* usage)
+{
+  if(usage == NULL) return -1;
+  switch(who) {
+    case USAGE_PROCESS:
+      process_usage(CURPROC, usage);
+      return 0;
+    case USAGE_THREAD: {
+      /* Preemption off, so that the scheduler does not update the counters while we copy them */
+      int preempt = preempt_off;
+      *usage = CURTHREAD->usage;
+      if(preempt) preempt_on;
+      return 0;
+    }
+    case USAGE_CHILDREN:
+      *usage = CURPROC->children_usage;
+      return 0;
+    default:
+      return -1;
+  }
 }
 
 
@@ -243,6 +347,12 @@ static void cleanup_zombie(PCB* pcb, int* status)
   if(status != NULL)
     *status = pcb->exitval;
 
+  /* The parent inherits the usage of the child, and of its reaped children */
+  resource_usage usage;
+  process_usage(pcb, &usage);
+  add_usage(&pcb->parent->children_usage, &usage);
+  add_usage(&pcb->parent->children_usage, &pcb->children_usage);
+
   rlist_remove(& pcb->children_node);
   rlist_remove(& pcb->exited_node);
 
@@ -339,8 +449,122 @@ void sys_Exit(int exitval)
 
 
 
+/*
+  The information stream.
+
+  The stream object is a cursor over the process table. A Read takes 
+  the kernel lock once for each record it returns, and copies the 
+  record to the caller's buffer after releasing it. A lock hold scans
+  at most one chunk of the table, so a large Read or a sparse table 
+  does not keep the kernel locked. A reader gets a consistent record 
+  for each process, but not a consistent snapshot of the whole table.
+
+  A read smaller than a record is served from a record kept in the 
+  stream object. The stream lock serializes Reads of the same stream,
+  and is taken before the kernel lock.
+ */
+typedef struct info_stream {
+  Mutex lock;       /* Serializes the Reads of the stream */
+  Pid_t cursor;     /* The next pid to look at */
+  procinfo rec;     /* A record being read in pieces */
+  size_t rec_pos;   /* The next byte of rec to read, or sizeof(rec) if none */
+} info_stream;
+
+static void fill_procinfo(procinfo* info, PCB* pcb)
+{
+  memset(info, 0, sizeof(procinfo));
+  info->pid = get_pid(pcb);
+  info->ppid = get_pid(pcb->parent);
+  info->alive = (pcb->pstate == ALIVE);
+  info->thread_count = pcb->thread_count;
+  info->main_task = pcb->main_task;
+  info->argl = pcb->argl;
+  size_t len = (pcb->argl < PROCINFO_MAX_ARGS_SIZE) ? pcb->argl : PROCINFO_MAX_ARGS_SIZE;
+  if(pcb->args != NULL && len > 0)
+    memcpy(info->args, pcb->args, len);
+  info->cpu_time = __atomic_load_n(&pcb->cpu_time, __ATOMIC_RELAXED);
+  info->wait_time = __atomic_load_n(&pcb->wait_time, __ATOMIC_RELAXED);
+  info->switches = __atomic_load_n(&pcb->switches, __ATOMIC_RELAXED);
+  info->sleeps = __atomic_load_n(&pcb->sleeps, __ATOMIC_RELAXED);
+  info->cpu_weight = pcb->cpu_weight;
+  info->cpu_quota = pcb->cpu_quota * 100 / SCHED_QUOTA_PERIOD;
+}
+
+/* 
+  Fill info with the next used PCB after the cursor. Returns 0 at the
+  end of the table. The kernel lock is taken for one chunk at a time.
+ */
+static int info_next(info_stream* s, procinfo* info)
+{
+  int found = 0;
+  while(! found) {
+    kernel_lock();
+    if(s->cursor >= pt_chunks*PT_CHUNK_SIZE) {
+      kernel_unlock();
+      break;
+    }
+    PCB* chunk = PT[s->cursor / PT_CHUNK_SIZE];
+    Pid_t end = (s->cursor / PT_CHUNK_SIZE + 1) * PT_CHUNK_SIZE;
+    for(; !found && s->cursor < end; s->cursor++) {
+      PCB* pcb = &chunk[s->cursor % PT_CHUNK_SIZE];
+      if(pcb->pstate != FREE) {
+        fill_procinfo(info, pcb);
+        found = 1;
+      }
+    }
+    kernel_unlock();
+  }
+  return found;
+}
+
+static int info_read(void* this, char* buf, unsigned int size)
+{
+  info_stream* s = this;
+  unsigned int count = 0;
+
+  Mutex_Lock(&s->lock);
+  while(count < size) {
+    if(s->rec_pos == sizeof(procinfo)) {
+      if(! info_next(s, &s->rec)) break;
+      s->rec_pos = 0;
+    }
+    size_t n = sizeof(procinfo) - s->rec_pos;
+    if(n > size - count) n = size - count;
+    memcpy(buf + count, ((char*) &s->rec) + s->rec_pos, n);
+    s->rec_pos += n;
+    count += n;
+  }
+  Mutex_Unlock(&s->lock);
+
+  return count;
+}
+
+static int info_close(void* this)
+{
+  free(this);
+  return 0;
+}
+
+static file_ops info_fops = {
+  .Open = NULL,
+  .Read = info_read,
+  .Write = NULL,
+  .Close = info_close
+};
+
 Fid_t sys_OpenInfo()
 {
-	return NOFILE;
+  Fid_t fid;
+  FCB* fcb;
+  if(! FCB_reserve(1, &fid, &fcb))
+    return NOFILE;
+
+  info_stream* s = xmalloc(sizeof(info_stream));
+  s->lock = MUTEX_INIT;
+  s->cursor = 0;
+  s->rec_pos = sizeof(procinfo);
+
+  FCB_set_stream(fcb, s, &info_fops);
+  return fid;
 }
 
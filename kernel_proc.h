@@ -33,6 +33,21 @@ typedef enum pid_state_e {
   ZOMBIE  /**< @brief The PID is held by a zombie */
 } pid_state;
 
+/**
+  @brief A slot of the thread handle table of a process.
+
+  A @c Tid_t is a handle for a PTCB: it holds the slot of the PTCB in the 
+  table of its process, and the generation of the slot when the thread was
+  created. The generation of a slot grows each time the slot is freed, so
+  a stale handle (of a thread that has been joined, or has exited detached)
+  does not match its slot any more.
+ */
+typedef struct thread_handle {
+  PTCB* ptcb;      /**< @brief The thread in this slot, or NULL if the slot is free */
+  uintptr_t gen;   /**< @brief The generation of the slot */
+  int next_free;   /**< @brief The next free slot, if this slot is free, or -1 */
+} thread_handle;
+
 /**
   @brief Process Control Block.
 
@@ -40,12 +55,15 @@ typedef enum pid_state_e {
  */
 typedef struct process_control_block {
   pid_state  pstate;      /**< @brief The pid state for this PCB */
+  Pid_t pid;              /**< @brief The pid of this PCB (fixed) */
 
   PCB* parent;            /**< @brief Parent's pcb. */
   int exitval;            /**< @brief The exit value of the process */
 
-  rlnode thread_list;  	  /* The list of threads of the process*/
-  uint thread_count;	  /* The number of threads in the process*/
+  thread_handle* thread_table; /**< @brief The PTCBs of the process, indexed by the slot of their @c Tid_t */
+  uint thread_slots;      /**< @brief The size of @c thread_table */
+  int thread_free;        /**< @brief The first free slot of @c thread_table, or -1 */
+  uint thread_count;	  /**< @brief The number of live threads in the process */
 
   Task main_task;         /**< @brief The main thread's function */
   int argl;               /**< @brief The main thread's argument length */
@@ -64,6 +82,19 @@ typedef struct process_control_block {
                              @c WaitChild() */
 
   FCB* FIDT[MAX_FILEID];  /**< @brief The fileid table of the process */
+  Mutex fidt_lock;        /**< @brief Protects @c FIDT */
+
+  /* CPU accounting. These are updated by the scheduler, without the kernel lock. */
+  unsigned long cpu_time;     /**< @brief The CPU time used by the threads of the process, in usec */
+  unsigned long wait_time;    /**< @brief The time the threads of the process waited for a core, in usec */
+  unsigned long switches;     /**< @brief The number of times the threads of the process were given a core */
+  unsigned long sleeps;       /**< @brief The number of times the threads of the process gave up a core voluntarily */
+  resource_usage children_usage; /**< @brief The usage of the reaped children (see @c GetRUsage) */
+  uint cpu_weight;            /**< @brief The share of the process under the fair policy (see @c SetCpuShare) */
+  TimerDuration cpu_quota;    /**< @brief The CPU time allowed per accounting period, or 0 for no limit */
+  TimerDuration quota_period; /**< @brief The current accounting period (as a multiple of @c SCHED_QUOTA_PERIOD) */
+  TimerDuration period_usage; /**< @brief The CPU time used in @c quota_period */
+  uint runnable;              /**< @brief The number of threads of the process that are ready or running */
 
 } PCB;
 
@@ -82,6 +113,7 @@ void initialize_processes();
   This function will return a pointer to the PCB of 
   the process with a given PID. If the PID does not
   correspond to a process, the function returns @c NULL.
+  The lookup takes constant time, and does not need the kernel lock.
 
   @param pid the pid of the process 
   @returns A pointer to the PCB of the process, or NULL.
@@ -100,6 +132,41 @@ PCB* get_pcb(Pid_t pid);
 */
 Pid_t get_pid(PCB* pcb);
 
+/**
+  @brief Create a PTCB in a process.
+
+  The new PTCB gets a handle (see @c thread_handle) in the thread table of
+  @c pcb. The caller must spawn its thread.
+  Must be called with the kernel lock held.
+
+  @param pcb the process
+  @param task the task of the thread
+  @param argl the argument length of the task
+  @param args the argument of the task
+  @returns the new PTCB
+*/
+PTCB* acquire_PTCB(PCB* pcb, Task task, int argl, void* args);
+
+/**
+  @brief Get the PTCB of a thread handle, in a process.
+
+  This takes constant time.
+  Must be called with the kernel lock held.
+
+  @param pcb the process
+  @param tid the thread handle
+  @returns the PTCB, or NULL if @c tid is not a handle of a thread of @c pcb 
+    (including a stale handle)
+*/
+PTCB* get_ptcb(PCB* pcb, Tid_t tid);
+
+/**
+  @brief Release the thread table of a process, with the PTCBs in it.
+
+  This is called when the last thread of the process exits.
+*/
+void release_thread_table(PCB* pcb);
+
 /** @} */
 
 #endif
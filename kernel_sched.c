@@ -15,35 +15,48 @@
    The thread layout.
   --------------------
 
-  On the x86 (Pentium) architecture, the stack grows upward. Therefore, we
-  can allocate the TCB at the top of the memory block used as the stack.
+  On the x86 architecture, the stack grows downward. Therefore, we
+  allocate the TCB at the top of the memory block used as the stack, and 
+  a guard page at the bottom.
 
   +-------------+
   |   TCB       |
   +-------------+
+  | first frame |
+  +-------------+
+  |      |      |
+  |      v      |
   |             |
   |    stack    |
   |             |
-  |      ^      |
-  |      |      |
   +-------------+
-  | first frame |
+  | guard page  |
   +-------------+
 
-  Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
-  crash own thread, before it affects other threads (which may make debugging
-  easier).
+  The guard page is not accessible, so that a stack overrun crashes the
+  thread with a segmentation fault, before it corrupts other memory. The
+  memory block is reserved with mmap, and the OS only commits the pages of the 
+  stack that are actually touched. Thus, threads that use little of their 
+  stack are cheap.
 
-  Disadvantages: The stack cannot grow unless we move the whole TCB. Of course,
-  we do not support stack growth anyway!
+  Disadvantages: The stack cannot grow beyond the size given at the creation
+  of the thread. Of course, we do not support stack growth anyway!
  */
 
 /*
   A counter for active threads. By "active", we mean 'existing',
   with the exception of idle threads (they don't count).
+  It is updated with atomic instructions.
+ */
+unsigned int active_threads = 0;
+
+/*
+  Add to a statistics counter of a core. Only the core itself updates its 
+  counters, so this need not be atomic, but the counter is stored atomically, 
+  for readers on other cores.
  */
-volatile unsigned int active_threads = 0;
-Mutex active_threads_spinlock = MUTEX_INIT;
+#define CORE_STAT_ADD(core, field, n) \
+	__atomic_store_n(&(core)->stats.field, (core)->stats.field + (n), __ATOMIC_RELAXED)
 
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE (1 << 12)
@@ -52,47 +65,244 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 #define THREAD_TCB_SIZE \
 	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
+/* Round a stack size up to a multiple of SYSTEM_PAGE_SIZE */
+#define THREAD_STACK_ROUND(size) \
+	((((size) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
+
+/*
+  Build with -DMALLOC_THREAD_MEM to allocate threads with malloc instead.
+ */
+#ifndef MALLOC_THREAD_MEM
+#define MMAPPED_THREAD_MEM
+#endif
 
-//#define MMAPPED_THREAD_MEM
 #ifdef MMAPPED_THREAD_MEM
 
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
- */
-void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
+  Use mmap to allocate a thread, with a guard page below the stack.
 
-void* allocate_thread(size_t size)
+  The memory is also executable, since the stack may contain trampolines 
+  for calls to nested functions (a gcc extension). MAP_NORESERVE lets the
+  OS commit the stack pages lazily, without reserving swap space for them.
+ */
+static void free_thread(TCB* tcb, size_t stack_size)
 {
-	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	void* ptr = ((void*)tcb) - stack_size - SYSTEM_PAGE_SIZE;
+	CHECK(munmap(ptr, SYSTEM_PAGE_SIZE + stack_size + THREAD_TCB_SIZE));
+}
 
+static TCB* allocate_thread(size_t stack_size)
+{
+	void* ptr = mmap(NULL, SYSTEM_PAGE_SIZE + stack_size + THREAD_TCB_SIZE,
+		PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
 	CHECK((ptr == MAP_FAILED) ? -1 : 0);
 
-	return ptr;
+	/* The guard page */
+	CHECK(mprotect(ptr, SYSTEM_PAGE_SIZE, PROT_NONE));
+
+	return (TCB*)(ptr + SYSTEM_PAGE_SIZE + stack_size);
 }
 #else
 /*
-  Use malloc to allocate a thread. This is probably faster than  mmap, but
-  cannot be made easily to 'detect' stack overflow.
+  Use malloc to allocate a thread. This does not detect stack overflow, and
+  the stack is not executable.
  */
-void free_thread(void* ptr, size_t size) { free(ptr); }
+static void free_thread(TCB* tcb, size_t stack_size) { free(((void*)tcb) - stack_size); }
 
-void* allocate_thread(size_t size)
+static TCB* allocate_thread(size_t stack_size)
 {
-	void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
+	void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, stack_size + THREAD_TCB_SIZE);
 	CHECK((ptr == NULL) ? -1 : 0);
-	return ptr;
+	return (TCB*)(ptr + stack_size);
 }
 #endif
 
-#define SCHED_MAX_LEVEL 3
-#define SCHED_MAX_SCHEDULED 3
 
-volatile int scheduled = 0;
+/*
+  The thread cache.
+  -----------------
+
+  Exited threads with the default stack size do not return their memory 
+  block to the allocator. Instead, 
+  it is kept in a small cache of the core that released it, where the next
+  spawn_thread() on this core will find it. When a core cache overflows, half
+  of it is moved to a global pool, from which the core caches are refilled 
+  when they are empty. Only when the pool is full (or empty) is memory 
+  actually freed (or allocated).
+
+  A core cache is only accessed by its own core, with preemption off.
+  The global pool is protected by thread_pool_spinlock.
+ */
+
+/* The maximum number of blocks in a core cache */
+#define THREAD_CACHE_MAX 16
+
+/* The maximum number of blocks in the global pool */
+#define THREAD_POOL_MAX 256
 
+/* A free block is linked through the first word of its TCB */
+typedef struct thread_block {
+	struct thread_block* next;
+} thread_block;
+
+static thread_block* thread_pool = NULL;
+static uint thread_pool_size = 0;
+static Mutex thread_pool_spinlock = MUTEX_INIT;
+
+/*
+  Get a thread block from the cache of the current core, refilling it
+  from the global pool if needed. Return NULL if none is available.
+
+  *** MUST BE CALLED WITH PREEMPTION OFF ***
+ */
+static TCB* thread_cache_get()
+{
+	CCB* core = &CURCORE;
+
+	if (core->thread_cache == NULL && thread_pool_size > 0) {
+		Mutex_Lock(&thread_pool_spinlock);
+		while (thread_pool != NULL && core->thread_cache_size < THREAD_CACHE_MAX / 2) {
+			thread_block* blk = thread_pool;
+			thread_pool = blk->next;
+			thread_pool_size--;
+			blk->next = core->thread_cache;
+			core->thread_cache = blk;
+			core->thread_cache_size++;
+		}
+		Mutex_Unlock(&thread_pool_spinlock);
+	}
+
+	thread_block* blk = core->thread_cache;
+	if (blk != NULL) {
+		core->thread_cache = blk->next;
+		core->thread_cache_size--;
+		core->thread_cache_hits++;
+	} else {
+		core->thread_cache_misses++;
+	}
+	return (TCB*)blk;
+}
+
+/*
+  Return a thread block to the cache of the current core, spilling
+  half of the cache to the global pool if it is full.
+
+  *** MUST BE CALLED WITH PREEMPTION OFF ***
+ */
+static void thread_cache_put(TCB* tcb)
+{
+	CCB* core = &CURCORE;
+
+	if (core->thread_cache_size == THREAD_CACHE_MAX) {
+		Mutex_Lock(&thread_pool_spinlock);
+		while (core->thread_cache_size > THREAD_CACHE_MAX / 2) {
+			thread_block* blk = core->thread_cache;
+			core->thread_cache = blk->next;
+			core->thread_cache_size--;
+			if (thread_pool_size < THREAD_POOL_MAX) {
+				blk->next = thread_pool;
+				thread_pool = blk;
+				thread_pool_size++;
+			} else
+				free_thread((TCB*)blk, THREAD_STACK_SIZE);
+		}
+		Mutex_Unlock(&thread_pool_spinlock);
+	}
+
+	thread_block* blk = (thread_block*)tcb;
+	blk->next = core->thread_cache;
+	core->thread_cache = blk;
+	core->thread_cache_size++;
+}
+
+void thread_cache_stats(unsigned long* hits, unsigned long* misses)
+{
+	unsigned long h = 0, m = 0;
+	for (uint c = 0; c < MAX_CORES; c++) {
+		h += cctx[c].thread_cache_hits;
+		m += cctx[c].thread_cache_misses;
+	}
+	if (hits) *hits = h;
+	if (misses) *misses = m;
+}
+
+
+unsigned long context_switches()
+{
+	unsigned long n = 0;
+	for (uint c = 0; c < MAX_CORES; c++)
+		n += __atomic_load_n(&cctx[c].stats.switches, __ATOMIC_RELAXED);
+	return n;
+}
+
+void get_core_stats(uint core, core_stats* stats)
+{
+	core_stats* cs = &cctx[core].stats;
+	stats->switches = __atomic_load_n(&cs->switches, __ATOMIC_RELAXED);
+	stats->voluntary = __atomic_load_n(&cs->voluntary, __ATOMIC_RELAXED);
+	stats->involuntary = __atomic_load_n(&cs->involuntary, __ATOMIC_RELAXED);
+	stats->idle_time = __atomic_load_n(&cs->idle_time, __ATOMIC_RELAXED);
+	stats->steals = __atomic_load_n(&cs->steals, __ATOMIC_RELAXED);
+	stats->ticks_avoided = __atomic_load_n(&cs->ticks_avoided, __ATOMIC_RELAXED);
+}
+
+
+/*
+  The live threads.
+
+  Every thread gets a serial number when it is spawned, which is never
+  reused (unlike its TCB, which is recycled by the thread cache). A mutex
+  records its owner by serial number (see kernel_cc.c). A thread is in this
+  table, keyed by its serial number, from the time it is spawned until it
+  exits; the TCB found here may be used only while the lock of its bucket
+  is held. Serial numbers are consecutive, so a bucket holds more than one
+  thread only when more than LIVE_TABLE_SIZE threads are live.
+  Each bucket is protected by a spinlock, taken with preemption off.
+ */
+#define LIVE_TABLE_SIZE 1024
+
+typedef struct live_bucket {
+	Mutex lock;
+	rlnode list;
+} live_bucket;
+
+static live_bucket live_table[LIVE_TABLE_SIZE];
+
+/* The serial number of the last spawned thread. The idle threads have serial number 0. */
+static unsigned long last_serial = 0;
+
+static inline live_bucket* live_bucket_of(unsigned long serial)
+{
+	return &live_table[serial % LIVE_TABLE_SIZE];
+}
+
+/* Must be called with preemption off */
+static void live_insert(TCB* tcb)
+{
+	live_bucket* b = live_bucket_of(tcb->serial);
+	Mutex_Lock(&b->lock);
+	rlist_push_back(&b->list, rlnode_init(&tcb->live_node, tcb));
+	Mutex_Unlock(&b->lock);
+}
+
+/* Must be called with preemption off */
+static void live_remove(TCB* tcb)
+{
+	live_bucket* b = live_bucket_of(tcb->serial);
+	Mutex_Lock(&b->lock);
+	rlist_remove(&tcb->live_node);
+	Mutex_Unlock(&b->lock);
+}
+
+/* Return the live thread with a serial number, or NULL. Must be called holding the lock of its bucket. */
+static TCB* live_find(live_bucket* b, unsigned long serial)
+{
+	for (rlnode* n = b->list.next; n != &b->list; n = n->next)
+		if (n->tcb->serial == serial)
+			return n->tcb;
+	return NULL;
+}
 
 
 /*
@@ -116,8 +326,26 @@ static void thread_start()
 
 TCB* spawn_thread(PCB* pcb, void (*func)())
 {
-	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
+	return spawn_thread_stack(pcb, func, THREAD_STACK_SIZE);
+}
+
+TCB* spawn_thread_stack(PCB* pcb, void (*func)(), size_t stack_size)
+{
+	stack_size = THREAD_STACK_ROUND(stack_size);
+	assert(stack_size >= THREAD_STACK_MIN);
+
+	/* Try to recycle the memory of an exited thread */
+	TCB* tcb = NULL;
+	if (stack_size == THREAD_STACK_SIZE) {
+		int preempt = preempt_off;
+		tcb = thread_cache_get();
+		if (preempt)
+			preempt_on;
+	}
+
+	if (tcb == NULL)
+		tcb = allocate_thread(stack_size);
+	tcb->stack_size = stack_size;
 
 	/* Set the owner */
 	tcb->owner_pcb = pcb;
@@ -129,6 +357,14 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->thread_func = func;
 	tcb->wakeup_time = NO_TIMEOUT;
 	tcb->priority = 0;
+	tcb->serial = __atomic_add_fetch(&last_serial, 1, __ATOMIC_RELAXED);
+	tcb->boost_lock = NULL;
+	tcb->locks_held = 0;
+	tcb->core = &CURCORE; /* Start at the run queue of the spawning core */
+	tcb->vruntime = tcb->core->min_vruntime; /* Start level with the threads of the core */
+	tcb->exec_start = 0;
+	tcb->usage = (resource_usage) { 0 };
+	tcb->affinity = CPUMASK_ALL;
 	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
 
 	tcb->its = QUANTUM;
@@ -136,26 +372,29 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->last_cause = SCHED_IDLE;
 	tcb->curr_cause = SCHED_IDLE;
 
-	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+	/* Compute the stack segment address, it lies just below the TCB */
+	void* sp = ((void*)tcb) - stack_size;
 
 	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+	cpu_initialize_context(&tcb->context, sp, stack_size, thread_start);
 
 #ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
+	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + stack_size);
 #endif
 
 	/* increase the count of active threads */
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads++;
-	Mutex_Unlock(&active_threads_spinlock);
+	__atomic_add_fetch(&active_threads, 1, __ATOMIC_RELAXED);
+
+	int preempt = preempt_off;
+	live_insert(tcb);
+	if (preempt)
+		preempt_on;
 
 	return tcb;
 }
 
 /*
-  This is called with sched_spinlock locked !
+  This is called with the sched_lock of the thread's core locked !
  */
 void release_TCB(TCB* tcb)
 {
@@ -163,11 +402,14 @@ void release_TCB(TCB* tcb)
 	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
 
-	free_thread(tcb, THREAD_SIZE);
+	/* This is called from the scheduler, so preemption is off */
+	if (tcb->stack_size == THREAD_STACK_SIZE)
+		thread_cache_put(tcb);
+	else
+		free_thread(tcb, tcb->stack_size);
 
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads--;
-	Mutex_Unlock(&active_threads_spinlock);
+	/* The idle threads may see the count drop to 0 and exit, so all writes must be visible */
+	__atomic_sub_fetch(&active_threads, 1, __ATOMIC_RELEASE);
 }
 
 /*
@@ -183,89 +425,472 @@ void release_TCB(TCB* tcb)
 /* Core control blocks */
 CCB cctx[MAX_CORES];
 
+/* Code which runs outside a thread (e.g., before boot) runs as the idle thread */
+static void __attribute__((constructor)) initialize_current_threads()
+{
+	for (uint c = 0; c < MAX_CORES; c++)
+		cctx[c].current_thread = &cctx[c].idle_thread;
+}
+
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
+  Each core has its own scheduler queue, implemented as an array of
+  doubly linked lists, one per priority level. Each core also keeps
+  a timing wheel of its sleeping threads with a timeout.
+
+  Both of these structures are protected by the core's @c sched_lock.
+  A thread is always accessed under the lock of its core (tcb->core).
+  No code path holds two core locks, except for stealing, which locks
+  the two cores in the order of their ids.
+*/
+
 
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
+/*
+  Tickless scheduling.
+  --------------------
 
-  Both of these structures are protected by @c sched_spinlock.
+  When the run queue of a core is empty, the thread running on it has no 
+  competition, so the core does not arm its quantum timer (if there are 
+  timeouts pending, the timer is armed for the next tick of the timing wheel).
+  In this case, the core is marked @c tick_off. When a thread is added to the 
+  queue (or the timeout wheel) of a core which is @c tick_off, the quantum
+  timer is re-armed: directly, if this is the current core, or else via an ICI.
 */
 
-rlnode SCHED[SCHED_MAX_LEVEL]; /* The scheduler queue. SCHED[0] has the highest priority. */
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
+/* 
+  Account the time the core spent without a timer, and re-arm the quantum timer. 
 
+  *** MUST BE CALLED WITH core->sched_lock HELD, ON THE CORE ITSELF ***
+*/
+static void sched_tick_on(CCB* core)
+{
+	if (!core->tick_off)
+		return;
+
+	if (core->tick_off_since != NO_TIMEOUT)
+		CORE_STAT_ADD(core, ticks_avoided, (bios_clock() - core->tick_off_since) / QUANTUM);
+	core->tick_off = 0;
+	core->tick_off_since = NO_TIMEOUT;
+	bios_set_timer(QUANTUM);
+}
+
+/*
+  Make sure that a core notices a new ready thread or timeout.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static void sched_notify_core(CCB* core)
+{
+	if (core == &CURCORE)
+		sched_tick_on(core);
+	else if (core->tick_off)
+		cpu_ici(core->id); /* This also restarts the core, if halted */
+	else
+		cpu_core_restart(core->id);
+}
 
 /* Interrupt handler for ALARM */
 void yield_handler() { yield(SCHED_QUANTUM); }
 
 /* Interrupt handle for inter-core interrupts */
 void ici_handler()
-{ /* noop for now... */
+{
+	/* Another core has given us work, we may need our quantum timer back */
+	int preempt = preempt_off;
+	CCB* core = &CURCORE;
+	Mutex_Lock(&core->sched_lock);
+	sched_tick_on(core);
+	Mutex_Unlock(&core->sched_lock);
+	if (preempt)
+		preempt_on;
+}
+
+/*
+  Lock the core that a thread belongs to, and return it.
+
+  Since the core of a thread may change (when it is stolen) while
+  we are waiting for the lock, we have to re-check after locking.
+*/
+static CCB* sched_lock_thread(TCB* tcb)
+{
+	while (1) {
+		CCB* core = __atomic_load_n(&tcb->core, __ATOMIC_ACQUIRE);
+		Mutex_Lock(&core->sched_lock);
+		if (core == tcb->core)
+			return core;
+		Mutex_Unlock(&core->sched_lock);
+	}
+}
+
+/*
+  Lock two cores (which may be the same), in the order of their ids.
+ */
+static void sched_lock_pair(CCB* a, CCB* b)
+{
+	if (a == b)
+		Mutex_Lock(&a->sched_lock);
+	else if (a->id < b->id) {
+		Mutex_Lock(&a->sched_lock);
+		Mutex_Lock(&b->sched_lock);
+	} else {
+		Mutex_Lock(&b->sched_lock);
+		Mutex_Lock(&a->sched_lock);
+	}
+}
+
+static void sched_unlock_pair(CCB* a, CCB* b)
+{
+	Mutex_Unlock(&a->sched_lock);
+	if (a != b)
+		Mutex_Unlock(&b->sched_lock);
+}
+
+/* Return true if the thread may run on the given core */
+static inline int sched_allowed(TCB* tcb, CCB* core)
+{
+	return (tcb->affinity & CPUMASK(core->id)) != 0;
 }
 
 /*
-  Possibly add TCB to the scheduler timeout list.
+  Return the least loaded core in the mask, or NULL if the mask contains
+  no core. The loads are read without locking, as a hint.
+ */
+static CCB* sched_pick_core(cpumask_t mask)
+{
+	CCB* best = NULL;
+	uint minload = 0;
+	for (uint c = 0; c < cpu_cores(); c++) {
+		if (!(mask & CPUMASK(c)))
+			continue;
+		uint load = __atomic_load_n(&cctx[c].ready_count, __ATOMIC_RELAXED);
+		if (best == NULL || load < minload) {
+			best = &cctx[c];
+			minload = load;
+		}
+	}
+	return best;
+}
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+/*
+  The timeout wheel of a core is a hashed timing wheel. A thread sleeping
+  with a timeout is put in the slot of the first tick (of length SCHED_WHEEL_TICK)
+  at or after its wakeup time. Therefore, inserting and removing a thread is O(1), 
+  and expiring needs only look at the slots of the ticks that passed since the 
+  last expiration. Wakeup times further than a full turn of the wheel simply stay 
+  in their slot for more turns.
+*/
+static inline rlnode* sched_wheel_slot(CCB* core, TimerDuration tick)
+{
+	return &core->timeout_wheel[tick & (SCHED_WHEEL_SIZE - 1)];
+}
+
+/*
+  Add TCB to the timeout wheel of the core, according to its wakeup time.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static void sched_wheel_insert(CCB* core, TCB* tcb)
+{
+	/* Find the tick of the wakeup time, but do not go into a slot already expired */
+	TimerDuration tick = (tcb->wakeup_time + SCHED_WHEEL_TICK - 1) / SCHED_WHEEL_TICK;
+	if (tick <= core->wheel_tick)
+		tick = core->wheel_tick + 1;
+
+	rlist_push_back(sched_wheel_slot(core, tick), &tcb->sched_node);
+	core->timeout_count++;
+}
+
+/*
+  Possibly add TCB to the timeout wheel of its core.
+
+  *** MUST BE CALLED WITH tcb->core->sched_lock HELD ***
 */
 static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 {
 	if (timeout != NO_TIMEOUT) {
 		/* set the wakeup time */
 		TimerDuration curtime = bios_clock();
-		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
+		tcb->wakeup_time = curtime + timeout;
 
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
+		sched_wheel_insert(tcb->core, tcb);
 	}
 }
 
 
-	
+/*
+  The ready bitmap of a core marks the non-empty levels of its run queue.
+  The following helpers keep it in sync with the queues.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static inline void sched_level_push(CCB* core, int level, TCB* tcb)
+{
+	rlist_push_back(&core->ready_queue[level], &tcb->sched_node);
+	core->ready_bitmap[level / SCHED_WORD_BITS] |= 1ul << (level % SCHED_WORD_BITS);
+}
+
+static inline TCB* sched_level_pop(CCB* core, int level)
+{
+	TCB* tcb = rlist_pop_front(&core->ready_queue[level])->tcb;
+	if (is_rlist_empty(&core->ready_queue[level]))
+		core->ready_bitmap[level / SCHED_WORD_BITS] &= ~(1ul << (level % SCHED_WORD_BITS));
+	return tcb;
+}
+
+static inline void sched_level_remove(CCB* core, TCB* tcb)
+{
+	int level = tcb->priority;
+	rlist_remove(&tcb->sched_node);
+	if (is_rlist_empty(&core->ready_queue[level]))
+		core->ready_bitmap[level / SCHED_WORD_BITS] &= ~(1ul << (level % SCHED_WORD_BITS));
+}
+
+/* Return the highest priority non-empty level of the core, or -1 if there is none */
+static inline int sched_first_level(CCB* core)
+{
+	for (uint w = 0; w < SCHED_BITMAP_WORDS; w++)
+		if (core->ready_bitmap[w])
+			return w * SCHED_WORD_BITS + __builtin_ctzl(core->ready_bitmap[w]);
+	return -1;
+}
+
+
+/*
+  The fair policy.
+  ----------------
+
+  With the fair policy, the run queue of a core is a heap of threads, ordered
+  by their virtual runtime, i.e., the time they have spent running. The thread
+  that has run the least is selected next. The heap is a pairing heap, linked
+  through the TCBs, so that it needs no memory allocation. A thread is inserted
+  in O(1) time, and the minimum, or any other thread, is removed in O(log n)
+  amortized time.
+
+  Each core tracks (roughly) the smallest virtual runtime of its threads, in
+  @c min_vruntime. A thread that was sleeping is placed no earlier than
+  @c SCHED_FAIR_CREDIT before it, and a thread that moves to another core
+  keeps its distance from the @c min_vruntime of its core.
+*/
+sched_policy_t sched_policy = SCHED_DEFAULT_POLICY;
+
+/* The policy of the next boot, copied to sched_policy by initialize_scheduler() */
+static sched_policy_t requested_policy = SCHED_DEFAULT_POLICY;
+
+sched_policy_t set_sched_policy(sched_policy_t policy)
+{
+	sched_policy_t old = requested_policy;
+	requested_policy = policy;
+	return old;
+}
+
+/* Meld two heaps: the root with the larger vruntime becomes the first child of the other. */
+static TCB* fair_meld(TCB* a, TCB* b)
+{
+	if (a == NULL) return b;
+	if (b == NULL) return a;
+	if (b->vruntime < a->vruntime) {
+		TCB* t = a; a = b; b = t;
+	}
+	b->heap_prev = a;
+	b->heap_next = a->heap_child;
+	if (a->heap_child != NULL)
+		a->heap_child->heap_prev = b;
+	a->heap_child = b;
+	return a;
+}
+
+/* Meld a list of sibling heaps into one, in two passes */
+static TCB* fair_meld_siblings(TCB* first)
+{
+	/* Meld pairs from left to right, collecting the results in reverse order */
+	TCB* pairs = NULL;
+	while (first != NULL) {
+		TCB* a = first;
+		TCB* b = a->heap_next;
+		first = (b != NULL) ? b->heap_next : NULL;
+		a->heap_next = a->heap_prev = NULL;
+		if (b != NULL)
+			b->heap_next = b->heap_prev = NULL;
+		TCB* m = fair_meld(a, b);
+		m->heap_next = pairs;
+		pairs = m;
+	}
+
+	/* Meld the pairs from right to left */
+	TCB* root = NULL;
+	while (pairs != NULL) {
+		TCB* next = pairs->heap_next;
+		pairs->heap_next = NULL;
+		root = fair_meld(root, pairs);
+		pairs = next;
+	}
+	return root;
+}
+
+static void fair_push(CCB* core, TCB* tcb)
+{
+	tcb->heap_child = tcb->heap_next = tcb->heap_prev = NULL;
+	core->fair_root = fair_meld(core->fair_root, tcb);
+}
+
+static TCB* fair_pop(CCB* core)
+{
+	TCB* tcb = core->fair_root;
+	core->fair_root = fair_meld_siblings(tcb->heap_child);
+	tcb->heap_child = NULL;
+	return tcb;
+}
+
+static void fair_remove(CCB* core, TCB* tcb)
+{
+	if (tcb == core->fair_root) {
+		fair_pop(core);
+		return;
+	}
+
+	/* Cut the subtree of tcb, and meld its children back into the heap */
+	if (tcb->heap_prev->heap_child == tcb)
+		tcb->heap_prev->heap_child = tcb->heap_next;
+	else
+		tcb->heap_prev->heap_next = tcb->heap_next;
+	if (tcb->heap_next != NULL)
+		tcb->heap_next->heap_prev = tcb->heap_prev;
+
+	TCB* children = fair_meld_siblings(tcb->heap_child);
+	tcb->heap_child = tcb->heap_next = tcb->heap_prev = NULL;
+	core->fair_root = fair_meld(core->fair_root, children);
+}
+
+/*
+  Keep the distance of the virtual runtime of a thread from the min_vruntime
+  of its core, when it moves from core @c from to core @c to.
+ */
+static inline void fair_rebase(TCB* tcb, CCB* from, CCB* to)
+{
+	long lag = (long)(tcb->vruntime - from->min_vruntime);
+	tcb->vruntime = (lag < 0 && (TimerDuration)(-lag) > to->min_vruntime) ? 0 : to->min_vruntime + lag;
+}
+
+
+/*
+  The run queue of a core, for either policy. These helpers also keep
+  core->ready_count up to date.
+
+  *** MUST BE CALLED WITH core->sched_lock HELD ***
+*/
+static inline void sched_rq_push(CCB* core, TCB* tcb)
+{
+	if (sched_policy == SCHED_POLICY_FAIR)
+		fair_push(core, tcb);
+	else
+		sched_level_push(core, tcb->priority, tcb);
+	core->ready_count++;
+}
+
+/* Remove and return the next thread to run, or NULL */
+static inline TCB* sched_rq_pop(CCB* core)
+{
+	TCB* tcb;
+	if (sched_policy == SCHED_POLICY_FAIR)
+		tcb = (core->fair_root == NULL) ? NULL : fair_pop(core);
+	else {
+		int level = sched_first_level(core);
+		tcb = (level < 0) ? NULL : sched_level_pop(core, level);
+	}
+	if (tcb != NULL) {
+		core->ready_count--;
+		if (core->handoff == tcb)
+			core->handoff = NULL;
+	}
+	return tcb;
+}
 
+/* The handoff target of a core is always in its run queue */
+static inline void sched_rq_remove(CCB* core, TCB* tcb)
+{
+	if (sched_policy == SCHED_POLICY_FAIR)
+		fair_remove(core, tcb);
+	else
+		sched_level_remove(core, tcb);
+	core->ready_count--;
+	if (core->handoff == tcb)
+		core->handoff = NULL;
+}
 
 /*
-  Add TCB to the end of the scheduler list.
+  Add TCB to the end of the scheduler list of its core.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->core->sched_lock HELD ***
 */
 static void sched_queue_add(TCB* tcb)
 {
+	CCB* core = tcb->core;
+
 	/* Insert at the end of the scheduling list based on its priority level */
-	rlist_push_back(&SCHED[tcb->priority], &tcb->sched_node);
+	sched_rq_push(core, tcb);
 
-	/* Restart possibly halted cores */
+	/* Notify the core, and restart possibly halted cores, which may steal */
+	sched_notify_core(core);
 	cpu_core_restart_one();
 }
 
+/*
+  Move a thread that is not running from its core to core @c to. 
+  A ready thread is moved to the run queue of @c to, and a thread sleeping
+  with a timeout is moved to the timeout wheel of @c to.
+
+  *** MUST BE CALLED WITH THE sched_lock OF BOTH CORES HELD ***
+*/
+static void sched_move_thread(TCB* tcb, CCB* to)
+{
+	CCB* from = tcb->core;
+	assert(tcb->phase == CTX_CLEAN);
+
+	if (tcb->state == READY)
+		sched_rq_remove(from, tcb);
+	else if (tcb->wakeup_time != NO_TIMEOUT) {
+		rlist_remove(&tcb->sched_node);
+		from->timeout_count--;
+	}
+
+	fair_rebase(tcb, from, to);
+	__atomic_store_n(&tcb->core, to, __ATOMIC_RELEASE);
+
+	if (tcb->state == READY) {
+		sched_rq_push(to, tcb);
+		sched_notify_core(to);
+	} else if (tcb->wakeup_time != NO_TIMEOUT) {
+		sched_wheel_insert(to, tcb);
+		sched_notify_core(to);
+	}
+}
+
 /*
 	Adjust the state of a thread to make it READY.
 
-	*** MUST BE CALLED WITH sched_spinlock HELD ***
+	*** MUST BE CALLED WITH tcb->core->sched_lock HELD ***
  */
 static void sched_make_ready(TCB* tcb)
 {
 	assert(tcb->state == STOPPED || tcb->state == INIT);
 
-	/* Possibly remove from TIMEOUT_LIST */
+	/* Possibly remove from the timeout wheel */
 	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
+		/* tcb is in the timeout wheel, fix it */
 		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
 		rlist_remove(&tcb->sched_node);
 		tcb->wakeup_time = NO_TIMEOUT;
+		tcb->core->timeout_count--;
 	}
 
 	/* Mark as ready */
 	tcb->state = READY;
+	tcb->ready_since = bios_clock_hires();
+	__atomic_add_fetch(&tcb->owner_pcb->runnable, 1, __ATOMIC_RELAXED);
+
+	/* A thread that has been sleeping gets a limited credit of virtual runtime */
+	CCB* core = tcb->core;
+	if (sched_policy == SCHED_POLICY_FAIR && tcb->vruntime + SCHED_FAIR_CREDIT < core->min_vruntime)
+		tcb->vruntime = core->min_vruntime - SCHED_FAIR_CREDIT;
 
 	/* Possibly add to the scheduler queue */
 	if (tcb->phase == CTX_CLEAN)
@@ -273,66 +898,250 @@ static void sched_make_ready(TCB* tcb)
 }
 
 /*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
+  Charge CPU time to a thread and its process. 
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  Under the fair policy, the virtual runtime of the thread grows in proportion 
+  to the number of ready threads of its process, and inversely to the weight 
+  of the process, so that processes (rather than threads) share the CPU 
+  according to their weights.
+
+  Returns the time until the end of the accounting period, if the process
+  has exceeded its quota, or else 0.
+*/
+static inline TimerDuration fair_scale(PCB* pcb, TimerDuration runtime)
+{
+	uint runnable = __atomic_load_n(&pcb->runnable, __ATOMIC_RELAXED);
+	return runtime * (runnable > 0 ? runnable : 1) * CPU_WEIGHT_DEFAULT / pcb->cpu_weight;
+}
+
+static TimerDuration sched_charge(TCB* tcb, TimerDuration runtime, TimerDuration now)
+{
+	PCB* pcb = tcb->owner_pcb;
+	tcb->usage.run_time += runtime;
+	__atomic_add_fetch(&pcb->cpu_time, runtime, __ATOMIC_RELAXED);
+	tcb->vruntime += fair_scale(pcb, runtime);
+
+	if (pcb->cpu_quota == 0)
+		return 0;
+
+	/* The first core to see a new period resets the usage */
+	TimerDuration period = now / SCHED_QUOTA_PERIOD;
+	TimerDuration last = __atomic_load_n(&pcb->quota_period, __ATOMIC_RELAXED);
+	if (last != period && __atomic_compare_exchange_n(&pcb->quota_period, &last, period, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		__atomic_store_n(&pcb->period_usage, 0, __ATOMIC_RELAXED);
+
+	TimerDuration usage = __atomic_add_fetch(&pcb->period_usage, runtime, __ATOMIC_RELAXED);
+	return (usage > pcb->cpu_quota) ? (period + 1) * SCHED_QUOTA_PERIOD - now : 0;
+}
+
+/*
+  Return the CPU time left to a process in the current accounting period,
+  or NO_TIMEOUT if it has no quota.
+ */
+static TimerDuration sched_quota_left(PCB* pcb, TimerDuration now)
+{
+	if (pcb->cpu_quota == 0)
+		return NO_TIMEOUT;
+	if (__atomic_load_n(&pcb->quota_period, __ATOMIC_RELAXED) != now / SCHED_QUOTA_PERIOD)
+		return pcb->cpu_quota;
+	TimerDuration usage = __atomic_load_n(&pcb->period_usage, __ATOMIC_RELAXED);
+	return (usage < pcb->cpu_quota) ? pcb->cpu_quota - usage : 0;
+}
+
+/*
+  Scan the slots of the timeout wheel of the current core for the ticks
+  that passed since the last scan, and wake up the threads whose timeout 
+  has expired.
+
+  *** MUST BE CALLED WITH CURCORE.sched_lock HELD ***
 */
 static void sched_wakeup_expired_timeouts()
 {
-	/* Empty the timeout list up to the current time and wake up each thread */
+	CCB* core = &CURCORE;
 	TimerDuration curtime = bios_clock();
-
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
-		if (tcb->wakeup_time > curtime)
-			break;
-		sched_make_ready(tcb);
+	TimerDuration now_tick = curtime / SCHED_WHEEL_TICK;
+
+	if (now_tick <= core->wheel_tick)
+		return;
+
+	/* If more than a full turn has passed, every slot must be scanned once */
+	TimerDuration first_tick = core->wheel_tick + 1;
+	if (now_tick - core->wheel_tick >= SCHED_WHEEL_SIZE)
+		first_tick = now_tick - SCHED_WHEEL_SIZE + 1;
+	core->wheel_tick = now_tick;
+
+	for (TimerDuration tick = first_tick; tick <= now_tick && core->timeout_count > 0; tick++) {
+		rlnode* slot = sched_wheel_slot(core, tick);
+		rlnode* n = slot->next;
+		while (n != slot) {
+			TCB* tcb = n->tcb;
+			n = n->next;
+			/* Skip threads waiting for a later turn of the wheel */
+			if (tcb->wakeup_time <= curtime)
+				sched_make_ready(tcb);
+		}
 	}
 }
 
 /*
-  Remove the head of the scheduler list, if any, and
+  Remove the head of the scheduler list of the current core, if any, and
   return it. Return NULL if the list is empty.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH CURCORE.sched_lock HELD ***
 */
 static TCB* sched_queue_select(TCB* current)
 {
 	/*
-		Priority scheduling algorithm that selects a thread to be granted cpu time 
-		from the highest priority, non-empty queue.
-	 
+		Priority scheduling: select the head of the highest priority, 
+		non-empty level, found from the ready bitmap. With the fair 
+		policy, select the thread with the least virtual runtime.
+	 */
+	CCB* core = &CURCORE;
+
+	/* 
+		With the fair policy, a preempted thread is not in the heap, but it 
+		competes with it: it keeps the core if it has run the least.
 	 */
+	int keep = sched_policy == SCHED_POLICY_FAIR && current->state == READY 
+		&& current->curr_cause == SCHED_QUANTUM && current->type != IDLE_THREAD 
+		&& core->fair_root != NULL && current->vruntime <= core->fair_root->vruntime
+		&& sched_allowed(current, core);
+
+	TCB* next_thread = keep ? NULL : sched_rq_pop(core);
+
+	if (next_thread != NULL) {
+		/* Threads in the queue of a core are always allowed to run on it */
+		assert(sched_allowed(next_thread, core));
+
+		/* 
+		   From now on, the thread is owned by this core, although it is not 
+		   running yet. Mark it, so that it is not moved to another core. 
+		 */
+		next_thread->phase = CTX_DIRTY;
+	} else
+		next_thread = (current->state == READY && sched_allowed(current, core)) 
+			? current : &core->idle_thread;
+
+	next_thread->its = QUANTUM;
 
+	if (next_thread->vruntime > core->min_vruntime && next_thread->type != IDLE_THREAD)
+		core->min_vruntime = next_thread->vruntime;
+
+	return next_thread;
+}
 
-	rlnode* sel = &SCHED[0];
-	for(int i=0;i<=SCHED_MAX_LEVEL-1;i++){
-		if(scheduled <= SCHED_MAX_SCHEDULED){
-			if(!is_rlist_empty(&SCHED[i])){
-				sel = rlist_pop_front(&SCHED[i]);
-				break;
+/*
+  Try to move ready threads from the busiest core to the current core.
+
+  Half of the threads of the busiest core are taken, highest priorities
+  first, so that the priority order of the scheduler is preserved. Threads
+  whose affinity excludes the current core are skipped.
+  Returns the number of stolen threads.
+ */
+static uint sched_steal()
+{
+	int preempt = preempt_off;
+
+	CCB* self = &CURCORE;
+
+	/* Find the busiest core. The loads are read without locking, as a hint. */
+	CCB* victim = NULL;
+	uint maxload = 0;
+	for (uint c = 0; c < cpu_cores(); c++) {
+		uint load = __atomic_load_n(&cctx[c].ready_count, __ATOMIC_RELAXED);
+		if (&cctx[c] != self && load > maxload) {
+			maxload = load;
+			victim = &cctx[c];
+		}
+	}
+
+	uint stolen = 0;
+	if (victim != NULL) {
+		sched_lock_pair(self, victim);
+
+		uint quota = (victim->ready_count + 1) / 2;
+		if (sched_policy == SCHED_POLICY_FAIR) {
+			/* Take the threads with the least virtual runtime, putting back the disallowed ones */
+			TCB* skipped = NULL;
+			uint count = victim->ready_count;
+			while (count-- > 0 && stolen < quota) {
+				TCB* tcb = sched_rq_pop(victim);
+				if (!sched_allowed(tcb, self)) {
+					tcb->heap_next = skipped;
+					skipped = tcb;
+					continue;
+				}
+				fair_rebase(tcb, victim, self);
+				__atomic_store_n(&tcb->core, self, __ATOMIC_RELEASE);
+				sched_rq_push(self, tcb);
+				stolen++;
+			}
+			while (skipped != NULL) {
+				TCB* tcb = skipped;
+				skipped = tcb->heap_next;
+				sched_rq_push(victim, tcb);
 			}
-		} // After a certain number of scheduling decisions reverse the order of queue selection. 
-		else{ 
-			if(!is_rlist_empty(&SCHED[i%4])){
-				sel = rlist_pop_front(&SCHED[i%4]);
-				scheduled = 0;
-				break;
+		} else {
+			int first = sched_first_level(victim);
+			for (int level = first; first >= 0 && level < SCHED_MAX_LEVEL && stolen < quota; level++) {
+				rlnode* queue = &victim->ready_queue[level];
+				rlnode* n = queue->next;
+				while (n != queue && stolen < quota) {
+					TCB* tcb = n->tcb;
+					n = n->next;
+					if (!sched_allowed(tcb, self))
+						continue;
+					sched_rq_remove(victim, tcb);
+					__atomic_store_n(&tcb->core, self, __ATOMIC_RELEASE);
+					sched_rq_push(self, tcb);
+					stolen++;
+				}
 			}
 		}
+
+		sched_unlock_pair(self, victim);
+		CORE_STAT_ADD(self, steals, stolen);
 	}
-		
-	
 
-	TCB* next_thread = sel->tcb; /* When the list is empty, this is NULL */
+	if (preempt)
+		preempt_on;
 
-	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+	return stolen;
+}
 
-	next_thread->its = QUANTUM;
+int set_thread_affinity(TCB* tcb, cpumask_t mask)
+{
+	/* Only keep the cores of the machine */
+	mask &= (cpu_cores() < 64) ? (CPUMASK(cpu_cores()) - 1) : CPUMASK_ALL;
+	if (mask == 0)
+		return -1;
 
-	return next_thread;
+	int preempt = preempt_off;
+
+	/* Lock the core of the thread and the core it may have to move to */
+	CCB *from, *to;
+	while (1) {
+		from = __atomic_load_n(&tcb->core, __ATOMIC_ACQUIRE);
+		to = (mask & CPUMASK(from->id)) ? from : sched_pick_core(mask);
+		sched_lock_pair(from, to);
+		if (from == tcb->core)
+			break;
+		sched_unlock_pair(from, to);
+	}
+
+	tcb->affinity = mask;
+
+	/* A running thread is moved by the scheduler, when it stops running */
+	if (from != to && tcb->phase == CTX_CLEAN && tcb->state != EXITED)
+		sched_move_thread(tcb, to);
+
+	sched_unlock_pair(from, to);
+
+	if (preempt)
+		preempt_on;
+
+	return 0;
 }
 
 /*
@@ -345,15 +1154,15 @@ int wakeup(TCB* tcb)
 	/* Preemption off */
 	int oldpre = preempt_off;
 
-	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+	/* To touch tcb->state, we must get the spinlock of its core. */
+	CCB* core = sched_lock_thread(tcb);
 
 	if (tcb->state == STOPPED || tcb->state == INIT) {
 		sched_make_ready(tcb);
 		ret = 1;
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	Mutex_Unlock(&core->sched_lock);
 
 	/* Restore preemption state */
 	if (oldpre)
@@ -362,6 +1171,132 @@ int wakeup(TCB* tcb)
 	return ret;
 }
 
+int wakeup_handoff(TCB* tcb)
+{
+	int ret = 0;
+	int oldpre = preempt_off;
+
+	CCB* core = sched_lock_thread(tcb);
+
+	if (tcb->state == STOPPED || tcb->state == INIT) {
+		sched_make_ready(tcb);
+		ret = 1;
+
+		/* The handoff is only possible to a queued thread of this core */
+		if (SCHED_HANDOFF && core == &CURCORE && tcb->phase == CTX_CLEAN)
+			core->handoff = tcb;
+	}
+
+	Mutex_Unlock(&core->sched_lock);
+
+	if (oldpre)
+		preempt_on;
+
+	return ret;
+}
+
+/* Change the priority of a thread. Must be called holding the sched_lock of its core. */
+static void sched_set_priority(CCB* core, TCB* tcb, int priority)
+{
+	/* A thread in the run queue moves to its new level */
+	int queued = (tcb->state == READY && tcb->phase == CTX_CLEAN);
+	if (queued)
+		sched_rq_remove(core, tcb);
+	tcb->priority = priority;
+	if (queued)
+		sched_rq_push(core, tcb);
+}
+
+
+/*
+  Priority inheritance. The priority of the holder of a mutex is the best
+  of its own, and those of the threads which sleep for it. When a thread 
+  is boosted by the waiters of more than one mutex, it keeps the boost until
+  it unlocks the mutex of the last waiter. Mutexes record their owner by
+  serial number, and the owner is looked up among the live threads.
+ */
+void sched_boost(unsigned long owner, int priority, void* lock)
+{
+	if (sched_policy == SCHED_POLICY_FAIR)
+		return;
+
+	/* The owner may have exited, and its TCB may belong to another thread by now */
+	int preempt = preempt_off;
+	live_bucket* b = live_bucket_of(owner);
+	Mutex_Lock(&b->lock);
+	TCB* tcb = live_find(b, owner);
+	if (tcb != NULL) {
+		CCB* core = sched_lock_thread(tcb);
+		if (priority < tcb->priority && tcb->state != EXITED) {
+			if (tcb->boost_lock == NULL)
+				tcb->base_priority = tcb->priority;
+			tcb->boost_lock = lock;
+			sched_set_priority(core, tcb, priority);
+		}
+		Mutex_Unlock(&core->sched_lock);
+	}
+	Mutex_Unlock(&b->lock);
+
+	if (preempt)
+		preempt_on;
+}
+
+void sched_unboost(unsigned long owner, void* lock)
+{
+	TCB* tcb = CURTHREAD;
+	if (owner == tcb->serial) {
+		if (tcb->boost_lock != lock)
+			return;
+
+		int preempt = preempt_off;
+		CCB* core = &CURCORE;
+		Mutex_Lock(&core->sched_lock);
+		if (tcb->boost_lock == lock) {
+			tcb->priority = tcb->base_priority;
+			tcb->boost_lock = NULL;
+		}
+		Mutex_Unlock(&core->sched_lock);
+
+		if (preempt)
+			preempt_on;
+		return;
+	}
+
+	/* Another thread unlocked the mutex: the owner (if still alive) returns the priority */
+	if (owner == 0 || sched_policy == SCHED_POLICY_FAIR)
+		return;
+	int preempt = preempt_off;
+	live_bucket* b = live_bucket_of(owner);
+	Mutex_Lock(&b->lock);
+	tcb = live_find(b, owner);
+	if (tcb != NULL) {
+		CCB* core = sched_lock_thread(tcb);
+		if (tcb->boost_lock == lock) {
+			tcb->boost_lock = NULL;
+			sched_set_priority(core, tcb, tcb->base_priority);
+		}
+		Mutex_Unlock(&core->sched_lock);
+	}
+	Mutex_Unlock(&b->lock);
+
+	if (preempt)
+		preempt_on;
+}
+
+void sched_lock_released(unsigned long owner)
+{
+	int preempt = preempt_off;
+	live_bucket* b = live_bucket_of(owner);
+	Mutex_Lock(&b->lock);
+	TCB* tcb = live_find(b, owner);
+	if (tcb != NULL && __atomic_load_n(&tcb->locks_held, __ATOMIC_RELAXED) > 0)
+		__atomic_sub_fetch(&tcb->locks_held, 1, __ATOMIC_RELAXED);
+	Mutex_Unlock(&b->lock);
+
+	if (preempt)
+		preempt_on;
+}
+
 /*
   Atomically put the current process to sleep, after unlocking mx.
  */
@@ -373,22 +1308,34 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 	TCB* tcb = CURTHREAD;
 
 	int preempt = preempt_off;
-	Mutex_Lock(&sched_spinlock);
+
+	/* From now on, the TCB may be released at any time */
+	if (state == EXITED)
+		live_remove(tcb);
+
+	CCB* core = &CURCORE;
+	Mutex_Lock(&core->sched_lock);
+	assert(tcb->core == core);
 
 	/* mark the thread as stopped or exited */
 	tcb->state = state;
+	__atomic_sub_fetch(&tcb->owner_pcb->runnable, 1, __ATOMIC_RELAXED);
 
 	/* register the timeout (if any) for the sleeping thread */
 	if (state != EXITED)
 		sched_register_timeout(tcb, timeout);
 
-	/* Release mx */
+	/* Release the schduler spinlock before calling yield() !!! */
+	Mutex_Unlock(&core->sched_lock);
+
+	/* 
+		Release mx. A wakeup from now on makes us READY, and yield() keeps us 
+		running. This is done without the sched_lock, because unlocking a mutex 
+		may wake up a thread that sleeps for it. 
+	*/
 	if (mx != NULL)
 		Mutex_Unlock(mx);
 
-	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
-
 	/* call this to schedule someone else */
 	yield(cause);
 
@@ -412,8 +1359,16 @@ void yield(enum SCHED_CAUSE cause)
 	int preempt = preempt_off;
 
 	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
+	CCB* core = &CURCORE;
 
-	Mutex_Lock(&sched_spinlock);
+	Mutex_Lock(&core->sched_lock);
+
+	/* The timer is already canceled; gain() will decide about the next one */
+	if (core->tick_off) {
+		if (core->tick_off_since != NO_TIMEOUT)
+			CORE_STAT_ADD(core, ticks_avoided, (bios_clock() - core->tick_off_since) / QUANTUM);
+		core->tick_off = 0;
+	}
 
 	/* Update CURTHREAD state */
 	if (current->state == RUNNING)
@@ -423,41 +1378,83 @@ void yield(enum SCHED_CAUSE cause)
 	current->rts = remaining;
 	current->last_cause = current->curr_cause;
 	current->curr_cause = cause;
+	/* Charge the time the thread has run */
+	TimerDuration throttle = 0;
+	TimerDuration now = bios_clock_hires();
+	TimerDuration ran = (now > current->exec_start) ? now - current->exec_start : 0;
+	if (current->type != IDLE_THREAD) {
+		throttle = sched_charge(current, ran, now);
+		if (current->state == READY)
+			current->ready_since = now;
+		if (cause != SCHED_QUANTUM) {
+			current->usage.sleeps++;
+			__atomic_add_fetch(&current->owner_pcb->sleeps, 1, __ATOMIC_RELAXED);
+		}
+	} else
+		CORE_STAT_ADD(core, idle_time, ran);
+
 	/*
 		Change the priority of the tcb based on the cause of yield.
-
+		The fair policy does not use priorities. A thread sleeping 
+		on a mutex keeps its priority, and a thread running at a priority
+		lent by the waiters of a mutex is not demoted.
 	*/
-
-
-	//A cpu-bound thread has lower priority
-	if(cause == SCHED_QUANTUM && current->priority < SCHED_MAX_LEVEL-1){
-		current->priority++;
-	}
-	//An IO-bound thread has higher priority
-	if(cause == SCHED_IO && current->priority > 0){
-		current->priority--;
+	if (sched_policy != SCHED_POLICY_FAIR) {
+		//A cpu-bound thread has lower priority
+		if(cause == SCHED_QUANTUM && current->priority < SCHED_MAX_LEVEL-1 && current->boost_lock == NULL){
+			current->priority++;
+		}
+		//An IO-bound thread has higher priority
+		if(cause == SCHED_IO && current->priority > 0){
+			current->priority--;
+		}
 	}
-	//A thread "stuck" in a mutex
-	if(cause == SCHED_MUTEX && current->priority < SCHED_MAX_LEVEL-1){
-		current->priority++;
+
+	/* 
+		A thread whose process is over its quota sleeps until the next period.
+		Not if it holds a lock that other threads may wait for: it will be 
+		throttled at a later quantum.
+	*/
+	if (throttle > 0 && cause == SCHED_QUANTUM && current->state == READY 
+			&& __atomic_load_n(&current->locks_held, __ATOMIC_RELAXED) == 0) {
+		current->state = STOPPED;
+		__atomic_sub_fetch(&current->owner_pcb->runnable, 1, __ATOMIC_RELAXED);
+		sched_register_timeout(current, throttle);
 	}
 
 	/* Wake up threads whose sleep timeout has expired */
 	sched_wakeup_expired_timeouts();
 	
-	/* Get next */
-	TCB* next = sched_queue_select(current);
-	scheduled++;
+	/* 
+		Get next. If the current thread blocks after waking up another thread of this
+		core, the woken thread runs next, for the rest of the quantum.
+	 */
+	TCB* next;
+	if (core->handoff != NULL && current->state != READY) {
+		next = core->handoff;
+		sched_rq_remove(core, next);
+		next->phase = CTX_DIRTY;
+		next->its = (remaining >= QUANTUM / 10) ? remaining : QUANTUM;
+	} else
+		next = sched_queue_select(current);
+	core->handoff = NULL;
 	assert(next != NULL);
 	
 	/* Save the current TCB for the gain phase */
-	CURCORE.previous_thread = current;
+	core->previous_thread = current;
 	
-	Mutex_Unlock(&sched_spinlock);
+	Mutex_Unlock(&core->sched_lock);
 
 	
 	/* Switch contexts */
 	if (current != next) {
+		CORE_STAT_ADD(core, switches, 1);
+		if (current->type != IDLE_THREAD) {
+			if (cause == SCHED_QUANTUM && current->state == READY)
+				CORE_STAT_ADD(core, involuntary, 1);
+			else
+				CORE_STAT_ADD(core, voluntary, 1);
+		}
 		CURTHREAD = next;
 		cpu_swap_context(&current->context, &next->context);
 	}
@@ -482,7 +1479,8 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
+	CCB* core = &CURCORE;
+	Mutex_Lock(&core->sched_lock);
 
 	TCB* current = CURTHREAD;
 
@@ -490,10 +1488,31 @@ void gain(int preempt)
 	current->state = RUNNING;
 	current->phase = CTX_DIRTY;
 	current->rts = current->its;
-
-	/* Take care of the previous thread */
-	TCB* prev = CURCORE.previous_thread;
-	if (current != prev){
+	current->exec_start = bios_clock_hires();
+
+	/* Take care of the previous thread. It ran on this core, so it belongs to it. */
+	TCB* prev = core->previous_thread;
+
+	/* Account the time the thread waited in the run queue */
+	if (current->type != IDLE_THREAD) {
+		PCB* pcb = current->owner_pcb;
+		TimerDuration waited = (current->exec_start > current->ready_since) ? current->exec_start - current->ready_since : 0;
+		current->usage.wait_time += waited;
+		__atomic_add_fetch(&pcb->wait_time, waited, __ATOMIC_RELAXED);
+		if (current != prev) {
+			current->usage.switches++;
+			__atomic_add_fetch(&pcb->switches, 1, __ATOMIC_RELAXED);
+		}
+	}
+	TCB* migrating = NULL;
+	if (current != prev && prev->type != IDLE_THREAD && prev->state != EXITED 
+		&& !sched_allowed(prev, core)) {
+		/* Its affinity changed while it was running. It stays dirty until it is moved. */
+		assert(prev->core == core);
+		migrating = prev;
+	}
+	else if (current != prev){
+		assert(prev->core == core);
 		prev->phase = CTX_CLEAN;
 		if(prev->state == READY){
 			if (prev->type != IDLE_THREAD){
@@ -511,14 +1530,45 @@ void gain(int preempt)
 		}
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	/* 
+		Set the timer. If no other thread is ready on this core, we do not need
+		a quantum, except to expire the timeouts in time. However, a thread of a 
+		process with a quota is always interrupted when the quota runs out.
+	*/
+	TimerDuration timer = current->rts;
+	TimerDuration quota_left = (current->type == IDLE_THREAD) ? NO_TIMEOUT
+		: sched_quota_left(current->owner_pcb, current->exec_start);
+	if (quota_left != NO_TIMEOUT) {
+		if (quota_left < timer)
+			timer = (quota_left > QUANTUM / 10) ? quota_left : QUANTUM / 10;
+	} else if (SCHED_TICKLESS && core->ready_count == 0) {
+		TimerDuration now = bios_clock();
+		timer = (core->timeout_count > 0) ? SCHED_WHEEL_TICK - now % SCHED_WHEEL_TICK : 0;
+		core->tick_off = 1;
+		core->tick_off_since = (timer == 0) ? now : NO_TIMEOUT;
+	}
+	bios_set_timer(timer);
+
+	Mutex_Unlock(&core->sched_lock);
+
+	/* Move the previous thread to a core it may run on */
+	if (migrating != NULL) {
+		CCB* to = sched_pick_core(migrating->affinity);
+		sched_lock_pair(core, to);
+		migrating->phase = CTX_CLEAN;
+		if (migrating->state == READY) {
+			/* It is not in any queue */
+			fair_rebase(migrating, core, to);
+			__atomic_store_n(&migrating->core, to, __ATOMIC_RELEASE);
+			sched_queue_add(migrating);
+		} else
+			sched_move_thread(migrating, to);
+		sched_unlock_pair(core, to);
+	}
 
 	/* Reset preemption as needed */
 	if (preempt)
 		preempt_on;
-
-	/* Set a 1-quantum alarm */
-	bios_set_timer(current->rts);
 }
 
 static void idle_thread()
@@ -527,24 +1577,74 @@ static void idle_thread()
 	yield(SCHED_IDLE);
 
 	/* We come here whenever we cannot find a ready thread for our core */
-	while (active_threads > 0) {
-		cpu_core_halt();
+	while (1) {
+		/* 
+		   Check for work with interrupts off, so that an ICI raised after the
+		   check stays pending and prevents the halt.
+		 */
+		preempt_off;
+		if (__atomic_load_n(&active_threads, __ATOMIC_ACQUIRE) == 0)
+			break;
+
+		/* Before halting, try to get some work from a busy core */
+		if (sched_steal() == 0 && __atomic_load_n(&CURCORE.ready_count, __ATOMIC_ACQUIRE) == 0)
+			cpu_core_halt();
+		preempt_on;
 		yield(SCHED_IDLE);
 	}
 
 	/* If the idle thread exits here, we are leaving the scheduler! */
 	bios_cancel_timer();
-	cpu_core_restart_all();
+	for (uint c = 0; c < cpu_cores(); c++)
+		if (c != cpu_core_id)
+			cpu_ici(c);
+	preempt_on;
 }
 
 /*
-  Initialize the scheduler queue
+  Initialize the scheduler queues of all cores
  */
 void initialize_scheduler()
-{	for(int i=0;i<=SCHED_MAX_LEVEL;i++){
-	rlnode_init(&SCHED[i], NULL);
-}
-	rlnode_init(&TIMEOUT_LIST, NULL);
+{
+	sched_policy = requested_policy;
+
+	for (uint c = 0; c < MAX_CORES; c++) {
+		CCB* core = &cctx[c];
+		core->id = c;
+		core->current_thread = &core->idle_thread; /* The boot code runs as the idle thread */
+		core->idle_thread.locks_held = 0;
+		core->sched_lock = MUTEX_INIT;
+		for (int i = 0; i < SCHED_MAX_LEVEL; i++)
+			rlnode_init(&core->ready_queue[i], NULL);
+		for (uint w = 0; w < SCHED_BITMAP_WORDS; w++)
+			core->ready_bitmap[w] = 0;
+		core->ready_count = 0;
+		core->fair_root = NULL;
+		core->min_vruntime = 0;
+		core->handoff = NULL;
+		for (int i = 0; i < SCHED_WHEEL_SIZE; i++)
+			rlnode_init(&core->timeout_wheel[i], NULL);
+		core->wheel_tick = 0;
+		core->timeout_count = 0;
+		core->tick_off = 0;
+		core->tick_off_since = NO_TIMEOUT;
+		core->stats = (core_stats) { 0 };
+	}
+
+	for (int i = 0; i < LIVE_TABLE_SIZE; i++) {
+		live_table[i].lock = MUTEX_INIT;
+		rlnode_init(&live_table[i].list, NULL);
+	}
+
+#ifdef LOCK_PROFILE
+	static char sched_lock_names[MAX_CORES][24];
+	for (uint c = 0; c < cpu_cores(); c++) {
+		snprintf(sched_lock_names[c], sizeof(sched_lock_names[c]), "sched_lock[%u]", c);
+		lock_profile_name(&cctx[c].sched_lock, sched_lock_names[c]);
+	}
+	for (int i = 0; i < LIVE_TABLE_SIZE; i++)
+		lock_profile_name(&live_table[i].lock, "live_table");
+#endif
 }
 
 void run_scheduler()
@@ -558,13 +1658,17 @@ void run_scheduler()
 
 	curcore->idle_thread.owner_pcb = get_pcb(0);
 	curcore->idle_thread.type = IDLE_THREAD;
+	curcore->idle_thread.serial = 0;
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+	curcore->idle_thread.core = curcore;
+	curcore->idle_thread.affinity = CPUMASK(curcore->id);
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
 
 	curcore->idle_thread.its = QUANTUM;
 	curcore->idle_thread.rts = QUANTUM;
+	curcore->idle_thread.exec_start = bios_clock_hires();
 
 	curcore->idle_thread.curr_cause = SCHED_IDLE;
 	curcore->idle_thread.last_cause = SCHED_IDLE;
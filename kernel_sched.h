@@ -52,7 +52,8 @@ typedef enum {
   A @c CTX_CLEAN thread means that, the context stored in the TCB is up-to-date. 
   In this case, it is legal to swap context to this thread.
   A @c CTX_DIRTY thread marks the case when the thread was, or still is, being executed 
-  at some core, therefore its stored context should not be used.
+  at some core (or has been selected to execute next), therefore its stored context 
+  should not be used.
 
   The following **invariant** of the scheduler guarantees 
   correctness:  
@@ -84,7 +85,7 @@ typedef enum {
 enum SCHED_CAUSE {
 	SCHED_QUANTUM, /**< @brief The quantum has expired */
 	SCHED_IO, /**< @brief The thread is waiting for I/O */
-	SCHED_MUTEX, /**< @brief @c Mutex_Lock yielded on contention */
+	SCHED_MUTEX, /**< @brief @c Mutex_Lock slept on contention */
 	SCHED_PIPE, /**< @brief Sleep at a pipe or socket */
 	SCHED_POLL, /**< @brief The thread is polling a device */
 	SCHED_IDLE, /**< @brief The idle thread called yield */
@@ -101,6 +102,7 @@ typedef struct thread_control_block {
 	PCB* owner_pcb; /**< @brief This is null for a free TCB */
 
 	cpu_context_t context; /**< @brief The thread context */
+	size_t stack_size; /**< @brief The size of the thread stack, which lies just below the TCB */
 
 #ifndef NVALGRIND
 	unsigned valgrind_stack_id; /**< @brief Valgrind helper for stacks. 
@@ -113,8 +115,21 @@ typedef struct thread_control_block {
 	  */
 #endif
 
-	int priority;
+	int priority; /**< @brief The current priority level of the thread (0 is highest) */
+	int base_priority; /**< @brief The priority to return to, when the thread unlocks @c boost_lock */
+	void* boost_lock; /**< @brief The mutex whose waiter lent its priority to this thread, or NULL */
+	unsigned int locks_held; /**< @brief The number of mutexes (and the kernel lock) held by the thread,
+	                              not counting spinlocks (see kernel_cc.c) */
 	PTCB* ptcb;
+	CCB* core; /**< @brief The core whose run queue this thread belongs to.
+
+	  The scheduler state of the thread (@c state, @c phase, @c sched_node) is protected
+	  by the @c sched_lock of this core. The field only changes while holding that lock
+	  (when a thread is stolen or moved by another core, both cores are locked).
+	  A running thread is never moved.
+	  */
+	cpumask_t affinity; /**< @brief The cores this thread may run on. Unless it is running, 
+	                         a thread is always in the run queue of one of these cores. */
 	Thread_type type; /**< @brief The type of thread */
 	Thread_state state; /**< @brief The state of the thread */
 	Thread_phase phase; /**< @brief The phase of the thread */
@@ -124,6 +139,15 @@ typedef struct thread_control_block {
 	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler */
 
 	rlnode sched_node; /**< @brief Node to use when queueing in the scheduler lists */
+	unsigned long serial; /**< @brief A number which identifies the thread, never reused (0 for idle threads) */
+	rlnode live_node; /**< @brief Node in the table of live threads, until the thread exits */
+	TimerDuration vruntime; /**< @brief The virtual runtime of the thread, for the fair policy */
+	TimerDuration exec_start; /**< @brief When the thread last started running (see @c bios_clock_hires()) */
+	TimerDuration ready_since; /**< @brief When the thread last became ready to run */
+	resource_usage usage; /**< @brief The resource usage of the thread (see @c GetRUsage()) */
+	struct thread_control_block* heap_child; /**< @brief First child in the fair heap of the core */
+	struct thread_control_block* heap_next; /**< @brief Next sibling in the fair heap of the core */
+	struct thread_control_block* heap_prev; /**< @brief Previous sibling, or the parent for a first child */
 	TimerDuration its; /**< @brief Initial time-slice for this thread */
 	TimerDuration rts; /**< @brief Remaining time-slice for this thread */
 
@@ -133,14 +157,13 @@ typedef struct thread_control_block {
 } TCB;
 
 typedef struct process_thread_control_block{
-	TCB* tcb; // The thread of this PTCB
+	TCB* tcb; // The thread of this PTCB, while it has not exited
+	Tid_t tid; // The handle of this PTCB, or NOTHREAD once it is released
   	  
     int detached; // Takes value '1' if detached, '0' if not detached
     int exited; // Takes value '1' if exited, '0' if not exited
 	uint ref_count; // The number of threads that joined this PTCB
     int exitval; // The exit value of the Task
-  	
-    rlnode thread_list_node; /*Node to use when accessing the thread list */
   	  
     Task task;	//The task of the thread				
 
@@ -157,15 +180,111 @@ typedef struct process_thread_control_block{
  */
 #define THREAD_STACK_SIZE (128 * 1024)
 
+/** @brief The minimum thread stack size. */
+#define THREAD_STACK_MIN (16 * 1024)
+
+/** @brief The maximum thread stack size. */
+#define THREAD_STACK_MAX (64 * 1024 * 1024)
+
 /************************
  *
  *      Scheduler
  *
  ************************/
 
+/** @brief The number of priority levels of the scheduler.
+
+  Level 0 has the highest priority. This can be overriden at compile time 
+  (e.g., @c -DSCHED_MAX_LEVEL=64). Selecting the next thread costs the same 
+  regardless of the number of levels.
+ */
+#ifndef SCHED_MAX_LEVEL
+#define SCHED_MAX_LEVEL 3
+#endif
+
+/** @brief The number of bits in a word of the ready bitmap */
+#define SCHED_WORD_BITS (8 * sizeof(unsigned long))
+
+/** @brief The number of words in the ready bitmap */
+#define SCHED_BITMAP_WORDS ((SCHED_MAX_LEVEL + SCHED_WORD_BITS - 1) / SCHED_WORD_BITS)
+
+/** @brief The number of slots of the timing wheel of each core (a power of 2) */
+#ifndef SCHED_WHEEL_SIZE
+#define SCHED_WHEEL_SIZE 256
+#endif
+
+/** @brief The time span of a timing wheel slot, in microseconds */
+#define SCHED_WHEEL_TICK QUANTUM
+
+/** @brief Tickless scheduling.
+
+  If non-zero, a core whose run queue is empty does not arm its quantum timer.
+ */
+#ifndef SCHED_TICKLESS
+#define SCHED_TICKLESS 1
+#endif
+
+/** @brief Fair policy: the largest credit (in usec of virtual runtime) of a waking thread.
+
+  A thread that slept is placed at most this much before the smallest virtual runtime 
+  of its core, so that it runs soon, but cannot monopolize the core.
+ */
+#ifndef SCHED_FAIR_CREDIT
+#define SCHED_FAIR_CREDIT QUANTUM
+#endif
+
+/** @brief The accounting period for CPU quotas, in microseconds. 
+
+  A process whose threads have used up its quota (see @c SetCpuShare) is 
+  not scheduled until the end of the current period.
+ */
+#ifndef SCHED_QUOTA_PERIOD
+#define SCHED_QUOTA_PERIOD (10 * QUANTUM)
+#endif
+
+/** @brief Directed handoff.
+
+  If non-zero, a thread which blocks right after waking up another thread
+  on the same core passes the rest of its quantum to it (see @c wakeup_handoff()).
+ */
+#ifndef SCHED_HANDOFF
+#define SCHED_HANDOFF 1
+#endif
+
+/** @brief The default scheduling policy, see @c set_sched_policy() */
+#ifndef SCHED_DEFAULT_POLICY
+#define SCHED_DEFAULT_POLICY SCHED_POLICY_MLFQ
+#endif
+
+/** @brief The scheduling policy of the running kernel.
+
+  This is fixed while tinyos is running. 
+ */
+extern sched_policy_t sched_policy;
+
+/** @brief Scheduler statistics of a core.
+
+  Each counter is updated only by its own core, without locking. It can be
+  read at any time from any core (see @c get_core_stats()).
+ */
+typedef struct core_statistics {
+	unsigned long switches; /**< @brief The number of context switches */
+	unsigned long voluntary; /**< @brief Switches away from a thread which blocked or yielded */
+	unsigned long involuntary; /**< @brief Switches away from a thread preempted at the end of its quantum */
+	TimerDuration idle_time; /**< @brief Time spent in the idle thread (including halted), in microseconds */
+	unsigned long steals; /**< @brief Ready threads taken from the run queues of other cores */
+	unsigned long ticks_avoided; /**< @brief An estimate of the timer interrupts avoided by tickless scheduling */
+} core_stats;
+
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
+
+  Each core owns a run queue (a multi-level queue, or a heap for the fair
+  policy) and a timing wheel of sleeping threads with a timeout, both
+  protected by the core's @c sched_lock. A thread belongs to the run queue
+  of exactly one core (see @c TCB::core). Idle cores steal ready threads
+  from the busiest core before they halt.
  */
 typedef struct core_control_block {
 	uint id; /**< @brief The core id */
@@ -175,6 +294,28 @@ typedef struct core_control_block {
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 	sig_atomic_t preemption; /**< @brief Marks preemption, used by the locking code */
 
+	Mutex sched_lock; /**< @brief Spinlock for the scheduler data of this core */
+	rlnode ready_queue[SCHED_MAX_LEVEL]; /**< @brief The run queue. @c ready_queue[0] has the highest priority */
+	unsigned long ready_bitmap[SCHED_BITMAP_WORDS]; /**< @brief Bit @c i is set iff @c ready_queue[i] is non-empty */
+	uint ready_count; /**< @brief The number of threads in the run queue */
+	TCB* fair_root; /**< @brief The run queue of the fair policy: a heap ordered by @c TCB::vruntime */
+	TimerDuration min_vruntime; /**< @brief A lower bound (roughly) of the virtual runtime of the threads of the core */
+	TCB* handoff; /**< @brief A thread in the run queue, woken by the current thread, to run next
+	                   if the current thread blocks (see @c wakeup_handoff()) */
+	rlnode timeout_wheel[SCHED_WHEEL_SIZE]; /**< @brief The sleeping threads of this core with a timeout, 
+	                                            hashed by the tick of their wakeup time */
+	TimerDuration wheel_tick; /**< @brief The last tick whose wheel slot has been expired */
+	uint timeout_count; /**< @brief The number of threads in @c timeout_wheel */
+
+	int tick_off; /**< @brief Set when the core runs without a quantum timer (see @c SCHED_TICKLESS) */
+	TimerDuration tick_off_since; /**< @brief When the timer was last turned off, or @c NO_TIMEOUT */
+	core_stats stats; /**< @brief The statistics of this core */
+
+	void* thread_cache; /**< @brief Recycled thread memory blocks (TCB and stack), for fast thread creation */
+	uint thread_cache_size; /**< @brief The number of blocks in @c thread_cache */
+	unsigned long thread_cache_hits; /**< @brief Thread blocks taken from a cache */
+	unsigned long thread_cache_misses; /**< @brief Thread blocks that had to be allocated */
+
 } CCB;
 
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
@@ -220,6 +361,37 @@ extern CCB cctx[MAX_CORES];
 */
 TCB* spawn_thread(PCB* pcb, void (*func)());
 
+/**
+	@brief Create a new thread with the given stack size.
+
+	This is the same as @c spawn_thread(), except that the stack size of the
+	new thread is given. The size is rounded up to a multiple of the page size,
+	and must be between @c THREAD_STACK_MIN and @c THREAD_STACK_MAX.
+	Only the parts of the stack actually used by the thread are committed to
+	memory.
+
+	@param pcb  The process control block of the owning process
+	@param func The function to execute in the new thread.
+	@param stack_size The size of the stack of the new thread
+	@returns  A pointer to the TCB of the new thread, in the @c INIT state.
+	@see spawn_thread
+*/
+TCB* spawn_thread_stack(PCB* pcb, void (*func)(), size_t stack_size);
+
+/**
+	@brief Set the cores that a thread may run on.
+
+	The mask is restricted to the cores of the machine. If the thread is not
+	running and its core is not in the mask, it is moved to the least loaded
+	core of the mask. A running thread is moved by the scheduler after it
+	stops running.
+
+	@param tcb the thread
+	@param mask the set of cores
+	@returns 0 on success, or -1 if the mask contains no core of the machine
+*/
+int set_thread_affinity(TCB* tcb, cpumask_t mask);
+
 
 /**
   @brief Wakeup a blocked thread.
@@ -233,6 +405,63 @@ TCB* spawn_thread(PCB* pcb, void (*func)());
 */
 int wakeup(TCB* tcb);
 
+/**
+  @brief Wakeup a blocked thread, to run next if the current thread blocks.
+
+  This is the same as @c wakeup(), but if the woken thread is queued on the current
+  core, it is also remembered as the target of a handoff: if the current thread
+  blocks before it is preempted, the woken thread runs next, in the rest of the 
+  quantum of the current thread, instead of waiting its turn in the run queue. 
+  This cuts the latency of producer/consumer exchanges.
+
+  @param tcb the thread to be made @c READY.
+  @returns 1 if the thread state was @c STOPPED or @c INIT, 0 otherwise
+  @see wakeup
+*/
+int wakeup_handoff(TCB* tcb);
+
+/**
+  @brief Lend a priority to the thread holding a mutex.
+
+  This is called by a thread about to sleep for mutex @c lock, which is held by
+  the thread with serial number @c owner. If @c priority is higher than the 
+  priority of the owner, then the owner runs at @c priority, until it unlocks
+  @c lock (see @c sched_unboost()). This way, the holder of a mutex is not kept
+  from running by threads of lower priority than the threads which wait for the
+  mutex (priority inheritance).
+  The fair policy has no priorities, and this call does nothing.
+
+  The owner of a mutex may exit (without unlocking it) at any time, and its
+  TCB may be recycled for another thread. Therefore, the owner is given by 
+  its serial number, and nothing is done if it has exited.
+
+  @param owner the serial number of the thread holding @c lock
+  @param priority the priority of the waiting thread
+  @param lock the mutex
+*/
+void sched_boost(unsigned long owner, int priority, void* lock);
+
+/**
+  @brief Return the priority lent to the owner of a mutex, when the mutex is unlocked.
+
+  If the owner of @c lock runs at the priority lent by a waiter of @c lock, it
+  gets back its own priority. This is normally the current thread, but a mutex
+  may be unlocked by another thread.
+  @param owner the serial number of the thread which held @c lock
+  @param lock the mutex
+  @see sched_boost
+*/
+void sched_unboost(unsigned long owner, void* lock);
+
+/**
+  @brief Stop counting a mutex in the locks held by its owner.
+
+  This is called when a mutex is unlocked by a thread other than its owner,
+  which is looked up among the live threads by its serial number.
+  @param owner the serial number of the thread which held the mutex
+*/
+void sched_lock_released(unsigned long owner);
+
 /** 
   @brief Block the current thread.
 
@@ -290,6 +519,39 @@ void run_scheduler(void);
  */
 void initialize_scheduler(void);
 
+/**
+  @brief Return statistics of the thread memory caches.
+
+  Threads are created from memory blocks recycled by exited threads,
+  if possible. This function returns the number of creations that found 
+  a recycled block (hits) and that had to allocate a new one (misses), 
+  summed over all cores.
+
+  @param hits if not NULL, the number of hits is stored here
+  @param misses if not NULL, the number of misses is stored here
+ */
+void thread_cache_stats(unsigned long* hits, unsigned long* misses);
+
+/**
+  @brief Return the number of context switches, summed over all cores.
+
+  A context switch is counted whenever @c yield() passes a core to a
+  different thread (including the idle thread).
+ */
+unsigned long context_switches(void);
+
+/**
+  @brief Read the statistics of a core.
+
+  This takes no lock, so it can be called from anywhere, while the core runs.
+  Each counter is read atomically, but the counters are not a consistent 
+  snapshot of each other.
+
+  @param core the core id
+  @param stats the statistics are stored here
+ */
+void get_core_stats(uint core, core_stats* stats);
+
 /**
   @brief Quantum (in microseconds) 
 
@@ -11,6 +11,21 @@
 FCB FT[MAX_FILES];
 rlnode FCB_freelist;
 
+/*
+  The locking of streams. 
+
+  The I/O system calls do not hold the kernel lock. Instead:
+  - FCB_lock protects the free list of FCBs,
+  - the fidt_lock of each process protects its FIDT,
+  - the reference count of an FCB is updated atomically, and
+  - each device (stream object) does its own locking.
+
+  An FCB is held by a reference while it is used by a system call, so
+  that a Close by another thread does not release it. Locks are taken
+  in the order: kernel lock, fidt_lock, FCB_lock.
+ */
+static Mutex FCB_lock = MUTEX_INIT;
+
 
 void initialize_files()
 {
@@ -26,32 +41,38 @@ void initialize_files()
 
 FCB* acquire_FCB()
 {
+  FCB* fcb = NULL;
+  Mutex_Lock(&FCB_lock);
   if(! is_rlist_empty(& FCB_freelist)) {
-    FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
+    fcb = rlist_pop_front(& FCB_freelist)->fcb;
     fcb->refcount = 0;
-    return fcb;
+    fcb->streamobj = NULL;
+    fcb->streamfunc = NULL;
   }
-  else
-    return NULL;
+  Mutex_Unlock(&FCB_lock);
+  return fcb;
 }
 
 void release_FCB(FCB* fcb)
 {
+  Mutex_Lock(&FCB_lock);
   rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  Mutex_Unlock(&FCB_lock);
 }
 
 
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount++;
+  __atomic_add_fetch(&fcb->refcount, 1, __ATOMIC_RELAXED);
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount --;
-  if(fcb->refcount==0) {
+  if(__atomic_sub_fetch(&fcb->refcount, 1, __ATOMIC_ACQ_REL)==0) {
+    /* Reserved FCBs are never dropped here, but by FCB_unreserve */
+    assert(fcb->streamfunc);
     int retval = fcb->streamfunc->Close(fcb->streamobj);
     release_FCB(fcb);
     return retval;
@@ -67,7 +88,9 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
     PCB* cur = CURPROC;
     size_t f=0;
     uint i;
+    int ret = 0;
 
+    Mutex_Lock(&cur->fidt_lock);
     /* Find distinct fids */
     for(i=0; i<num; i++) {
 	while(f<MAX_FILEID && cur->FIDT[f]!=NULL)
@@ -75,7 +98,7 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	if(f==MAX_FILEID) break;
 	fid[i] = f; f++;
     }
-    if(i<num) return 0;
+    if(i<num) goto finish;
     /* Allocate FCBs */
     for(i=0;i<num;i++)
 	if((fcb[i] = acquire_FCB()) == NULL)
@@ -86,14 +109,17 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	    release_FCB(fcb[i-1]);
 	    i--;
 	}
-	return 0;
+	goto finish;
     }
     /* Found all */
     for(i=0;i<num;i++) {
 	cur->FIDT[fid[i]]=fcb[i];
 	FCB_incref(fcb[i]);
     }
-    return 1;
+    ret = 1;
+finish:
+    Mutex_Unlock(&cur->fidt_lock);
+    return ret;
 }
 
 
@@ -101,11 +127,14 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
+    Mutex_Lock(&cur->fidt_lock);
     for(size_t i=0; i<num ; i++) {
-	assert(cur->FIDT[fid[i]]==fcb[i]);
+	/* Nobody else can have taken a reference to a reserved FCB */
+	assert(cur->FIDT[fid[i]]==fcb[i] && fcb[i]->refcount==1);
 	cur->FIDT[fid[i]] = NULL;
 	release_FCB(fcb[i]);
     }
+    Mutex_Unlock(&cur->fidt_lock);
 }
 
 
@@ -120,41 +149,46 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
  */
 
 
+void FCB_set_stream(FCB* fcb, void* sobj, file_ops* sfunc)
+{
+  fcb->streamobj = sobj;
+  __atomic_store_n(&fcb->streamfunc, sfunc, __ATOMIC_RELEASE);
+}
+
+
 FCB* get_fcb(Fid_t fid)
 {
   if(fid < 0 || fid >= MAX_FILEID) return NULL;
 
-  return CURPROC->FIDT[fid];
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->fidt_lock);
+  FCB* fcb = cur->FIDT[fid];
+  /* A reserved FCB is not usable until its stream is set up */
+  if(fcb != NULL && __atomic_load_n(&fcb->streamfunc, __ATOMIC_ACQUIRE) != NULL)
+    FCB_incref(fcb);
+  else
+    fcb = NULL;
+  Mutex_Unlock(&cur->fidt_lock);
+  return fcb;
 }
 
 
 int sys_Read(Fid_t fd, char *buf, unsigned int size)
 {
   int retcode = -1;
-  int (*devread)(void*,char*,uint);
-  void* sobj;
 
-  
-  /* Get the fields from the stream */
+  /* The reference makes sure that the stream will not be closed 
+     (by another thread) while we are using it! */
   FCB* fcb = get_fcb(fd);
 
   if(fcb) {
-    sobj = fcb->streamobj;
-    devread = fcb->streamfunc->Read;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
+    int (*devread)(void*,char*,uint) = fcb->streamfunc->Read;
     if(devread)
-      retcode = devread(sobj, buf, size);
+      retcode = devread(fcb->streamobj, buf, size);
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
   }
-  
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
-
 
   return retcode;
 }
@@ -163,48 +197,40 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
 int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 {
   int retcode = -1;
-  int (*devwrite)(void*, const char*, uint) = NULL;
-  void* sobj = NULL;
 
-  
-  /* Get the fields from the stream */
+  /* The reference makes sure that the stream will not be closed 
+     (by another thread) while we are using it! */
   FCB* fcb = get_fcb(fd);
 
   if(fcb) {
-
-    sobj = fcb->streamobj;
-    devwrite = fcb->streamfunc->Write;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
-
+    int (*devwrite)(void*, const char*, uint) = fcb->streamfunc->Write;
     if(devwrite)
-      retcode = devwrite(sobj, buf, size);
+      retcode = devwrite(fcb->streamobj, buf, size);
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
-
   }
 
-
   return retcode;
 }
 
 
 int sys_Close(int fd)
 {
-  int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
-
-  FCB* fcb = get_fcb(fd);
-
-  if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
-    retcode = FCB_decref(fcb);    
+  if(fd<0 || fd>=MAX_FILEID) return -1;  /* Closing a closed fd is legal! */
+
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->fidt_lock);
+  FCB* fcb = cur->FIDT[fd];
+  /* A reserved fid belongs to the thread opening it, until it is published */
+  if(fcb != NULL && FCB_is_reserved(fcb)) {
+    Mutex_Unlock(&cur->fidt_lock);
+    return -1;
   }
+  cur->FIDT[fd] = NULL;
+  Mutex_Unlock(&cur->fidt_lock);
 
-  return retcode;
+  return fcb ? FCB_decref(fcb) : 0;
 }
 
 
@@ -214,6 +240,7 @@ int sys_Close(int fd)
   This call returns 0 on success and -1 on failure.
   Possible reasons for failure:
   - Either oldfd or newfd is invalid.
+  - Either oldfd or newfd is reserved by a thread which is opening it.
  */
 int sys_Dup2(int oldfd, int newfd)
 {
@@ -221,18 +248,25 @@ int sys_Dup2(int oldfd, int newfd)
   if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
     return -1;
 
-  FCB* old = get_fcb(oldfd);
-  FCB* new = get_fcb(newfd);
+  PCB* cur = CURPROC;
+  FCB* new = NULL;
 
-  if(old==NULL) {
+  Mutex_Lock(&cur->fidt_lock);
+  FCB* old = cur->FIDT[oldfd];
+  if(old==NULL || FCB_is_reserved(old)
+     || (cur->FIDT[newfd]!=NULL && FCB_is_reserved(cur->FIDT[newfd]))) {
     retcode = -1;
   }
-  else if(old!=new) {
-    if(new)
-      FCB_decref(new);
+  else if(old!=cur->FIDT[newfd]) {
+    new = cur->FIDT[newfd];
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    cur->FIDT[newfd] = old;
   }
+  Mutex_Unlock(&cur->fidt_lock);
+
+  /* The stream displaced from newfd may have to be closed */
+  if(new)
+    FCB_decref(new);
 
   return retcode;
 }
@@ -252,15 +286,18 @@ Fid_t open_stream(Device_type major, unsigned int minor)
 {
   Fid_t fid;
   FCB* fcb;
+  void* sobj;
+  file_ops* sfunc;
 
 
   if(! FCB_reserve(1, &fid, &fcb))
       goto finerr;
   
-  if(device_open(major, minor, & fcb->streamobj, &fcb->streamfunc)) {
+  if(device_open(major, minor, &sobj, &sfunc)) {
       FCB_unreserve(1, &fid, &fcb);
       goto finerr;
   }
+  FCB_set_stream(fcb, sobj, sfunc);
   
   goto finok;
 finerr:
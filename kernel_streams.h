@@ -20,8 +20,13 @@
 
 	The streams of each process are held in the file table of the
 	PCB of the process. The system calls generally use the API
-	of this file to access FCBs: @ref get_fcb, @ref FCB_reserve
-	and @ref FCB_unreserve.
+	of this file to access FCBs: @ref get_fcb, @ref FCB_reserve,
+	@ref FCB_set_stream and @ref FCB_unreserve.
+
+	The I/O system calls do not hold the kernel lock. The file table 
+	of each process is protected by its @c fidt_lock, the reference 
+	count of an FCB is atomic, and the stream objects (e.g., devices) 
+	must do their own locking.
 
 	Streams are connected to devices by virtue of a @c file_operations
 	object, which provides pointers to device-specific implementations
@@ -40,7 +45,7 @@
  */
 typedef struct file_control_block
 {
-  uint refcount;  			/**< @brief Reference counter. */
+  uint refcount;  			/**< @brief Reference counter (updated atomically). */
   void* streamobj;			/**< @brief The stream object (e.g., a device) */
   file_ops* streamfunc;		/**< @brief The stream implementation methods */
   rlnode freelist_node;		/**< @brief Intrusive list node */
@@ -87,6 +92,11 @@ int FCB_decref(FCB* fcb);
    If not, the state is unchanged (but the array contents
    may have been overwritten).
 
+   The new fids are not usable by @ref get_fcb until the stream of 
+   their FCB is set with @ref FCB_set_stream. Until then, they cannot
+   be closed, duplicated or inherited either, so the FCB stays owned
+   by the caller.
+
    If these resources are not needed, the operation can be
    reversed by calling @ref FCB_unreserve.
 
@@ -118,9 +128,35 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb);
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 
 
+/** @brief Set the stream of a reserved FCB.
+
+	This makes the FCB usable by other threads, so it must be the last
+	step of opening a stream.
+
+	@param fcb an FCB returned by @ref FCB_reserve
+	@param sobj the stream object
+	@param sfunc the stream implementation methods
+ */
+void FCB_set_stream(FCB* fcb, void* sobj, file_ops* sfunc);
+
+
+/** @brief Check if an FCB is reserved but its stream is not set yet.
+
+	@param fcb an FCB held in some FIDT
+	@returns 1 if @ref FCB_set_stream has not been called on the FCB
+ */
+static inline int FCB_is_reserved(FCB* fcb)
+{
+	return __atomic_load_n(&fcb->streamfunc, __ATOMIC_ACQUIRE) == NULL;
+}
+
+
 /** @brief Translate an fid to an FCB.
 
 	This routine will return NULL if the fid is not legal.
+	Otherwise, the reference count of the FCB is increased, so that it 
+	is not released if another thread closes the fid. The caller must
+	release it with @ref FCB_decref.
 
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
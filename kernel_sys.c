@@ -12,33 +12,41 @@
  */
 
 
-#define PRE_CALL \
+/* The locking of each lock class (see kernel_sys.h) */
+#define PRE_CALL_PROC \
 kernel_lock();\
 
+#define POST_CALL_PROC \
+kernel_unlock();\
 
+#define PRE_CALL_IO
+#define POST_CALL_IO
 
-#define POST_CALL \
-kernel_unlock();\
+#define PRE_CALL_NOLOCK
+#define POST_CALL_NOLOCK
+
+#define PRE_CALL_SYNC
+#define POST_CALL_SYNC
 
 
 /* with return */
-#define SYSCALL(NAME, RET, SIG, ARGS)\
+#define SYSCALL(NAME, LOCK, RET, SIG, ARGS)\
 RET NAME SIG \
 {\
 	RET __ret;\
-	PRE_CALL\
+	PRE_CALL_##LOCK\
 	__ret = sys_##NAME ARGS;\
-	POST_CALL\
+	POST_CALL_##LOCK\
 	return __ret;\
 }\
 
 /* without return */
-#define SYSCALLV(NAME, SIG, ARGS)\
+#define SYSCALLV(NAME, LOCK, SIG, ARGS)\
 void NAME SIG \
 {\
-	PRE_CALL\
+	PRE_CALL_##LOCK\
 	sys_##NAME ARGS;\
-	POST_CALL\
+	POST_CALL_##LOCK\
 }\
 
 
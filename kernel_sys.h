@@ -4,39 +4,62 @@
 #include "bios.h"
 #include "tinyos.h"
 
+/*
+	The system calls. Each one is declared with its lock class, which
+	determines the locking done around it (see kernel_sys.c):
+
+	- PROC: process and thread management. The call holds the kernel lock,
+	  which protects the process table and the threads of processes.
+	- IO: streams and devices. The call takes no global lock; the file
+	  table, the FIDT of each process, the FCBs and the devices do their
+	  own locking, so that independent I/O calls run in parallel.
+	- NOLOCK: the call takes no lock at all. It must only read state which
+	  is immutable, or owned by the current thread, or a single word that 
+	  is read atomically, and it must not block. These calls do not
+	  contend with the others, and can be used in polling loops.
+	- SYNC: synchronization of user threads. The call takes no global lock,
+	  only the spinlocks of the wait table (see kernel_cc.c), and it may
+	  block.
+ */
 #define SYSCALLS \
-SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
-SYSCALLV(Exit, (int exitval), (exitval))\
-SYSCALL(GetPid, int, (void), ())\
-SYSCALL(GetPPid, int, (void), ())\
-SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
-SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
-SYSCALL(ThreadSelf, Tid_t, (void), ())\
-SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
-SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
-SYSCALLV(ThreadExit, (int exitval), (exitval))\
-SYSCALL(GetTerminalDevices, unsigned int, (), ())\
-SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
-SYSCALL(OpenNull, Fid_t, (), ())\
-SYSCALL(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
-SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
-SYSCALL(Close,int,(Fid_t fd),(fd))\
-SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
-SYSCALL(Pipe, int, (pipe_t* pipe), (pipe))\
-SYSCALL(Socket, Fid_t, (port_t port), (port))\
-SYSCALL(Listen, int, (Fid_t sock), (sock))\
-SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
-SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
-SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
-SYSCALL(OpenInfo, Fid_t, (), ())\
-
-
-
-#define SYSCALL(NAME, RET, SIG, ARGS)\
+SYSCALL(Exec, PROC, int, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALLV(Exit, PROC, (int exitval), (exitval))\
+SYSCALL(GetPid, NOLOCK, int, (void), ())\
+SYSCALL(GetPPid, NOLOCK, int, (void), ())\
+SYSCALL(SetCpuShare, PROC, int, (Pid_t pid, unsigned int weight, unsigned int quota), (pid, weight, quota))\
+SYSCALL(GetRUsage, PROC, int, (usage_who who, resource_usage* usage), (who, usage))\
+SYSCALL(WaitChild, PROC, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
+SYSCALL(CreateThread, PROC, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(CreateThreadStack, PROC, Tid_t, (Task task, int argl, void* args, unsigned int stack_size), (task, argl, args, stack_size))\
+SYSCALL(ThreadSelf, NOLOCK, Tid_t, (void), ())\
+SYSCALL(SetThreadAffinity, PROC, int, (Tid_t tid, cpumask_t mask), (tid, mask))\
+SYSCALL(ThreadJoin, PROC, int, (Tid_t tid, int* exitval), (tid, exitval))\
+SYSCALL(ThreadDetach, PROC, int, (Tid_t tid), (tid))\
+SYSCALLV(ThreadExit, PROC, (int exitval), (exitval))\
+SYSCALL(FutexWait, SYNC, int, (int* addr, int expected, timeout_t timeout), (addr, expected, timeout))\
+SYSCALL(FutexWake, SYNC, int, (int* addr, int n), (addr, n))\
+SYSCALL(GetTerminalDevices, NOLOCK, unsigned int, (), ())\
+SYSCALL(OpenTerminal, IO, Fid_t, (unsigned int termno), (termno))\
+SYSCALL(OpenNull, IO, Fid_t, (), ())\
+SYSCALL(Read, IO, int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL(Write, IO, int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL(Close, IO, int,(Fid_t fd),(fd))\
+SYSCALL(Dup2, IO, int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
+SYSCALL(Pipe, IO, int, (pipe_t* pipe), (pipe))\
+SYSCALL(Socket, IO, Fid_t, (port_t port), (port))\
+SYSCALL(Listen, IO, int, (Fid_t sock), (sock))\
+SYSCALL(Accept, IO, Fid_t, (Fid_t lsock), (lsock))\
+SYSCALL(Connect, IO, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
+SYSCALL(ShutDown, IO, int, (Fid_t sock, shutdown_mode how), (sock, how))\
+SYSCALL(OpenInfo, PROC, Fid_t, (), ())\
+
+
+
+#define SYSCALL(NAME, LOCK, RET, SIG, ARGS)\
 RET sys_ ## NAME SIG;
 
 /* without return */
-#define SYSCALLV(NAME, SIG, ARGS)\
+#define SYSCALLV(NAME, LOCK, SIG, ARGS)\
 void sys_ ## NAME SIG;
 
 SYSCALLS
@@ -6,6 +6,7 @@
 #include "kernel_proc.h"
 #include "kernel_cc.h"
 #include "kernel_streams.h"
+#include "kernel_pool.h"
 
 
 
@@ -20,51 +21,142 @@ void start_thread(){
 
 }
 
+/*
+  The thread table.
+
+  A Tid_t holds the slot of a PTCB in the thread table of its process (plus
+  one, so that it is never NOTHREAD), and the generation of the slot in the
+  upper bits. Looking up a Tid_t is an array access, and a stale Tid_t is 
+  detected because the generation of its slot has moved on.
+ */
+#define TID_SLOT_BITS 24
+#define TID_SLOT_MASK (((Tid_t)1 << TID_SLOT_BITS) - 1)
+
+/* PTCBs are recycled through a pool, with a cache on each core */
+static kernel_pool ptcb_pool = POOL_INIT(PTCB);
+
+PTCB* acquire_PTCB(PCB* pcb, Task task, int argl, void* args)
+{
+  PTCB* ptcb = pool_alloc(&ptcb_pool);
+  ptcb->tcb = NULL;
+  ptcb->exited = 0;
+  ptcb->detached = 0;
+  ptcb->ref_count = 0;
+  ptcb->exit_cv = COND_INIT;
+  ptcb->task = task;
+  ptcb->argl = argl;
+  ptcb->args = args;
+
+  /* Double the table if it is full, and put the new slots in the free list */
+  if(pcb->thread_free == -1) {
+    uint slots = (pcb->thread_slots == 0) ? 4 : 2*pcb->thread_slots;
+    CHECK_CONDITION(slots <= TID_SLOT_MASK);
+    thread_handle* table = xmalloc(slots * sizeof(thread_handle));
+    if(pcb->thread_table != NULL) {
+      memcpy(table, pcb->thread_table, pcb->thread_slots * sizeof(thread_handle));
+      free(pcb->thread_table);
+    }
+    for(int i = slots-1; i >= (int)pcb->thread_slots; i--) {
+      table[i].ptcb = NULL;
+      table[i].gen = 1;
+      table[i].next_free = pcb->thread_free;
+      pcb->thread_free = i;
+    }
+    pcb->thread_table = table;
+    pcb->thread_slots = slots;
+  }
+
+  int slot = pcb->thread_free;
+  thread_handle* h = &pcb->thread_table[slot];
+  pcb->thread_free = h->next_free;
+  h->ptcb = ptcb;
+  ptcb->tid = (h->gen << TID_SLOT_BITS) | (Tid_t)(slot + 1);
+
+  return ptcb;
+}
+
+PTCB* get_ptcb(PCB* pcb, Tid_t tid)
+{
+  Tid_t slot = (tid & TID_SLOT_MASK) - 1;
+  if(slot >= pcb->thread_slots)   /* This includes NOTHREAD */
+    return NULL;
+  thread_handle* h = &pcb->thread_table[slot];
+  return (h->ptcb != NULL && h->gen == (tid >> TID_SLOT_BITS)) ? h->ptcb : NULL;
+}
+
+/* Free the slot of a PTCB, so that its handle becomes stale */
+static void release_handle(PCB* pcb, PTCB* ptcb)
+{
+  if(ptcb->tid == NOTHREAD) return;
+  int slot = (ptcb->tid & TID_SLOT_MASK) - 1;
+  thread_handle* h = &pcb->thread_table[slot];
+  h->ptcb = NULL;
+  h->gen = (h->gen + 1) & (UINTPTR_MAX >> TID_SLOT_BITS);
+  h->next_free = pcb->thread_free;
+  pcb->thread_free = slot;
+  ptcb->tid = NOTHREAD;
+}
+
+/*
+  An exited thread which has been joined, or was detached, cannot be joined 
+  any more: its handle is released, and the PTCB is freed as soon as the
+  threads still in ThreadJoin for it have returned.
+ */
+static void release_PTCB(PCB* pcb, PTCB* ptcb)
+{
+  release_handle(pcb, ptcb);
+  if(ptcb->ref_count == 0)
+    pool_free(&ptcb_pool, ptcb);
+}
+
+void release_thread_table(PCB* pcb)
+{
+  for(uint i = 0; i < pcb->thread_slots; i++)
+    if(pcb->thread_table[i].ptcb != NULL)
+      pool_free(&ptcb_pool, pcb->thread_table[i].ptcb);
+  free(pcb->thread_table);
+  pcb->thread_table = NULL;
+  pcb->thread_slots = 0;
+  pcb->thread_free = -1;
+}
+
+
 /** 
   @brief Create a new thread in the current process.
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args)
 {
-  //Cache the current process
-  PCB* curproc = CURPROC;
-
-
-  //Allocate a new process thread 
-  PTCB* new_ptcb = (PTCB*)xmalloc(sizeof(PTCB)); 
-
-  //Initialize rlnode of the new PTCB  to point to itself
-  rlnode_init(&new_ptcb->thread_list_node, new_ptcb);
+  return sys_CreateThreadStack(task, argl, args, THREAD_STACK_SIZE);
+}
 
-  //Initialize ptcb values
-  new_ptcb->exited = 0;
-  new_ptcb->detached = 0;
-  new_ptcb->ref_count = 0;
-  new_ptcb->exit_cv = COND_INIT;
-  
+/** 
+  @brief Create a new thread in the current process, with the given stack size.
+  */
+Tid_t sys_CreateThreadStack(Task task, int argl, void* args, unsigned int stack_size)
+{
+  //Check the stack size
+  if(stack_size < THREAD_STACK_MIN || stack_size > THREAD_STACK_MAX)
+    return NOTHREAD;
 
-  //Pass arguments to the new process thread
-  new_ptcb->task = task; 
-  new_ptcb->argl = argl;
-  new_ptcb->args = args;
-  
+  //Cache the current process
+  PCB* curproc = CURPROC;
 
-  
-  //Add allocated process thread to the thread list of the current process
-  rlist_push_back(&curproc->thread_list, &new_ptcb->thread_list_node);
+  //Allocate a new process thread, with a handle in the current process
+  PTCB* new_ptcb = acquire_PTCB(curproc, task, argl, args);
 
   //Increase thread_count 
   curproc->thread_count++;
   
 
   //Spawn a new thread and add it to the new ptcb 
-  new_ptcb->tcb = spawn_thread(curproc,start_thread);
+  new_ptcb->tcb = spawn_thread_stack(curproc,start_thread,stack_size);
   new_ptcb->tcb->ptcb = new_ptcb;
 
   //Add the new thread to the scheduler queue
   wakeup(new_ptcb->tcb);
 
   //Return the new thread
-	return (Tid_t) new_ptcb;
+	return new_ptcb->tid;
 }
 
 /**
@@ -72,7 +164,31 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
  */
 Tid_t sys_ThreadSelf()
 {
-	return (Tid_t) CURTHREAD;
+	return CURTHREAD->ptcb->tid;
+}
+
+/**
+  @brief Set the cores the given thread may run on.
+  */
+int sys_SetThreadAffinity(Tid_t tid, cpumask_t mask)
+{
+  PTCB* ptcb = get_ptcb(CURPROC, tid);
+
+  //The thread must be a live thread of the current process
+  if(ptcb == NULL || ptcb->exited == 1){
+    return -1;
+  }
+
+  if(set_thread_affinity(ptcb->tcb, mask) == -1){
+    return -1;
+  }
+
+  //If the current thread may not stay on this core, let the scheduler move it now
+  if(ptcb->tcb == CURTHREAD && !(mask & CPUMASK(cpu_core_id))){
+    yield(SCHED_USER);
+  }
+
+  return 0;
 }
 
 /**
@@ -80,49 +196,41 @@ Tid_t sys_ThreadSelf()
   */
 int sys_ThreadJoin(Tid_t tid, int* exitval)
 {
+  PCB* curproc = CURPROC;
+  PTCB* ptcb = get_ptcb(curproc, tid);
 
-  PTCB* ptcb = (PTCB*)tid;
-  assert(ptcb != NULL);
   /*  Return error -1 if the thread to be joined is:
-      detached,
+      not a thread of the current process (or a stale handle),
       the current thread,
-      not in the thread list of the current process
+      detached
   */
-
-  if(ptcb->detached == 1 || ptcb->tcb == CURTHREAD || rlist_find(&CURPROC->thread_list,ptcb,NULL) != &ptcb->thread_list_node){
+  if(ptcb == NULL || ptcb == CURTHREAD->ptcb || ptcb->detached == 1){
     return -1;
   }
 
-//If the thread to be joined is already exited, return its exitval
-  if(ptcb->exited == 1){
-    return *exitval;
-  }
-
-  //Increase the ref_count of the joined ptcb
-    ptcb->ref_count++;
+  //Increase the ref_count of the joined ptcb, so that it is not freed while we wait
+  ptcb->ref_count++;
 
   //If the joined thread is not exited, wait for it to exit
   while(ptcb->exited == 0 && ptcb->detached == 0){
     kernel_wait(&ptcb->exit_cv,SCHED_USER);
   }
-  /*
-    Now, the joined thread has exited and I need not wait for it anymore
-  */
 
-  //Decrease the ref_count of the joined ptcb
-  if(ptcb->ref_count > 0){
-    ptcb->ref_count--;
-  }
+  ptcb->ref_count--;
 
-  //If the ref_count falls to zero,no thread is waiting for this thread to exit, so it can be released
-  if((ptcb->ref_count == 0 && rlist_find(&CURPROC->thread_list,&ptcb->thread_list_node,NULL) == &ptcb->thread_list_node && ptcb->detached == 0 )|| ptcb->detached == 1 ){
-    rlist_remove(&ptcb->thread_list_node);
-    free(ptcb);
-    //Decrease the thread_count of the current process, since one of its threads was removed from its thread_list
-    CURPROC->thread_count--;
+  //A thread detached while we waited cannot be joined
+  int ret = -1;
+  if(ptcb->detached == 0) {
+    if(exitval != NULL)
+      *exitval = ptcb->exitval;
+    ret = 0;
   }
 
-  return 0;
+  //The exited thread cannot be joined again
+  if(ptcb->exited == 1)
+    release_PTCB(curproc, ptcb);
+
+  return ret;
 }
 
 /**
@@ -130,11 +238,12 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
   */
 int sys_ThreadDetach(Tid_t tid)
 {
-  PTCB* ptcb = (PTCB*) tid;
+  PTCB* ptcb = get_ptcb(CURPROC, tid);
+  if(ptcb == NULL || ptcb->exited == 1)
+    return -1;
+
   /*
-  
     Mark the ptcb as detached and broadcast a signal, so that threads that have joined this ptcb cease to wait.
-
   */
   if(ptcb->detached == 0){
     ptcb->detached = 1;
@@ -158,18 +267,14 @@ void sys_ThreadExit(int exitval)
   current_ptcb->exitval = exitval;
   current_ptcb->exited = 1;
   current_ptcb->args = NULL;
+  current_ptcb->tcb = NULL;
   
   //Broadcast exit signal
   kernel_broadcast(&current_ptcb->exit_cv); 
 
-  //Remove the ptcb from the thread list and free it
+  //A detached thread cannot be joined, so its ptcb goes now. Else, it stays for ThreadJoin.
   if(current_ptcb->detached == 1){
-   rlist_remove(&current_ptcb->thread_list_node);
-    free(current_ptcb); 
-  }
-  if(current_ptcb->ref_count == 0 && current_ptcb->detached == 0){
-    rlist_remove(&current_ptcb->thread_list_node);
-    free(current_ptcb);
+    release_PTCB(curproc, current_ptcb);
   }
   
   //Decrease thread_count of the current procees
@@ -188,12 +293,17 @@ void sys_ThreadExit(int exitval)
         curproc->args = NULL;
       }
 
+      /* Free the threads that were never joined */
+      release_thread_table(curproc);
+
       /* Clean up FIDT */
       for(int i=0;i<MAX_FILEID;i++) {
-        if(curproc->FIDT[i] != NULL) {
-          FCB_decref(curproc->FIDT[i]);
-          curproc->FIDT[i] = NULL;
-        }
+        Mutex_Lock(&curproc->fidt_lock);
+        FCB* fcb = curproc->FIDT[i];
+        curproc->FIDT[i] = NULL;
+        Mutex_Unlock(&curproc->fidt_lock);
+        if(fcb != NULL)
+          FCB_decref(fcb);
       }
 
       /* Reparent any children of the exiting process to the 
@@ -201,7 +311,7 @@ void sys_ThreadExit(int exitval)
       PCB* initpcb = get_pcb(1);
       while(!is_rlist_empty(& curproc->children_list)) {
         rlnode* child = rlist_pop_front(& curproc->children_list);
-        child->pcb->parent = initpcb;
+        __atomic_store_n(&child->pcb->parent, initpcb, __ATOMIC_RELAXED);
         rlist_push_front(& initpcb->children_list, child);
       }
 
@@ -61,6 +61,15 @@ typedef uintptr_t Tid_t;
 /** @brief The invalid thread ID */
 #define NOTHREAD ((Tid_t)0)
 
+/** @brief A set of cpu cores, as a bitmask. Bit @f$ c @f$ stands for core @f$ c @f$. */
+typedef uint64_t cpumask_t;
+
+/** @brief The set containing core @c c */
+#define CPUMASK(c) (((cpumask_t)1) << (c))
+
+/** @brief The set of all cores */
+#define CPUMASK_ALL (~(cpumask_t)0)
+
 
 /*******************************************
  *      Concurrency control
@@ -70,13 +79,14 @@ typedef uintptr_t Tid_t;
   
     Mutexes are used extensively to surround critical sections. The TinyOS
     mutexes are suitable for use in user-space, as well as in the implementation 
-    of the kernel.
+    of the kernel. A locked mutex records the thread that locked it, so that
+    threads waiting for the mutex can lend it their priority.
 
     @see Mutex_Lock
     @see Mutex_Unlock
     @see MUTEX_INIT
 */
-typedef char Mutex;
+typedef uintptr_t Mutex;
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -92,7 +102,8 @@ typedef char Mutex;
 /** @brief Lock a mutex.
 
   Lock a mutex, by waiting if necessary, as long as it takes. In user-space and
-  in kernel-space (preemptive domain), the locking will yield after spinning for a few hundred times.
+  in kernel-space (preemptive domain), the locking will sleep after spinning for a few hundred times;
+  the sleeping threads are woken up one at a time, in FIFO order, as the mutex is unlocked.
   In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock.
 
   @see Mutex
@@ -101,6 +112,14 @@ typedef char Mutex;
   */
 void Mutex_Lock(Mutex*);
 
+#ifdef LOCK_PROFILE
+/* In a lock profiling build, Mutex_Lock passes its call site to the profiler */
+void Mutex_Lock_at(Mutex*, const char* site);
+#define __MUTEX_SITE2(file, line) file ":" #line
+#define __MUTEX_SITE(file, line) __MUTEX_SITE2(file, line)
+#define Mutex_Lock(mx) Mutex_Lock_at((mx), __MUTEX_SITE(__FILE__, __LINE__))
+#endif
+
 /** @brief Unlock a mutex that you locked. 
   
     This operation is non-blocking.
@@ -202,6 +221,153 @@ void Cond_Signal(CondVar*);
 void Cond_Broadcast(CondVar*); 
 
 
+/** @brief Reader-writer locks.
+
+  A reader-writer lock can be held by many readers at the same time, or
+  by a single writer. Readers which find the lock free of writers take it
+  with a single atomic operation, so they proceed in parallel on different
+  cores. Threads that have to wait sleep, as with @c Cond_Wait.
+
+  The lock is fair between readers and writers: a new reader waits while a
+  writer is waiting, and when a writer unlocks, the readers which waited for
+  it are let in before the next writer. Thus, neither readers nor writers
+  can starve.
+
+  @see RWLock_ReadLock
+  @see RWLock_WriteLock
+  @see RWLOCK_INIT
+ */
+typedef struct {
+  int state;            /**< The number of readers and flags, see kernel_cc.c */
+  int rwaiting;         /**< Readers sleeping for the lock */
+  int wwaiting;         /**< Writers sleeping for the lock */
+  unsigned int rphase;  /**< Advanced each time sleeping readers are let in */
+  Mutex mx;             /**< Protects the sleeping part of the lock */
+  CondVar readers;      /**< Sleeping readers wait here */
+  CondVar writers;      /**< Sleeping writers wait here */
+} RWLock;
+
+/** @brief  This macro is used to initialize reader-writer locks.
+
+   It is used as follows:
+  @code
+  RWLock my_rwlock = RWLOCK_INIT;
+  @endcode
+ */
+#define RWLOCK_INIT ((RWLock){ 0, 0, 0, 0, MUTEX_INIT, COND_INIT, COND_INIT })
+
+/** @brief Lock a reader-writer lock for reading.
+
+  The call waits as long as a writer holds the lock, or waits for it.
+  @see RWLock_ReadUnlock
+ */
+void RWLock_ReadLock(RWLock* rw);
+
+/** @brief Unlock a reader-writer lock that you locked for reading.
+  @see RWLock_ReadLock
+ */
+void RWLock_ReadUnlock(RWLock* rw);
+
+/** @brief Lock a reader-writer lock for writing.
+
+  The call waits as long as other threads hold the lock.
+  @see RWLock_WriteUnlock
+ */
+void RWLock_WriteLock(RWLock* rw);
+
+/** @brief Unlock a reader-writer lock that you locked for writing.
+  @see RWLock_WriteLock
+ */
+void RWLock_WriteUnlock(RWLock* rw);
+
+
+/** @brief Counting semaphores.
+
+  A semaphore holds a count. @c Sem_Down waits until the count
+  is positive and decrements it, and @c Sem_Up increments it. When there is
+  no need to wait, both operations take a single atomic operation. 
+  A semaphore can be destroyed as soon as no thread holds or waits for it, 
+  even if a thread that called @c Sem_Up has not returned yet.
+
+  @see Sem_Down
+  @see Sem_Up
+  @see SEM_INIT
+ */
+typedef struct {
+  int count;            /**< The count; if negative, minus the threads waiting in @c Sem_Down */
+  int wakeups;          /**< Wakeups given by @c Sem_Up to waiting threads */
+  Mutex mx;             /**< Protects the sleeping part of the semaphore */
+  CondVar cv;           /**< Sleeping threads wait here */
+} Semaphore;
+
+/** @brief  This macro is used to initialize semaphores.
+
+   It is used as follows:
+  @code
+  Semaphore my_sem = SEM_INIT(5);
+  @endcode
+ */
+#define SEM_INIT(n) ((Semaphore){ (n), 0, MUTEX_INIT, COND_INIT })
+
+/** @brief Decrement a semaphore, waiting as long as its count is zero.
+  @see Sem_Up
+ */
+void Sem_Down(Semaphore* sem);
+
+/** @brief Decrement a semaphore, if its count is positive.
+
+  This operation is non-blocking.
+  @returns 1 if the count was decremented, 0 otherwise
+  @see Sem_Down
+ */
+int Sem_TryDown(Semaphore* sem);
+
+/** @brief Increment a semaphore, waking up a thread waiting in @c Sem_Down.
+
+  This operation is non-blocking.
+  @see Sem_Down
+ */
+void Sem_Up(Semaphore* sem);
+
+
+/** @brief Wait on a futex.
+
+  A futex is an @c int in memory, which threads can wait on. Together with
+  atomic operations on the futex, it can be used to build new synchronization
+  primitives, which make no system call when there is no need to wait.
+
+  If the futex at @c addr holds the value @c expected, the calling thread 
+  sleeps until another thread calls @c FutexWake on @c addr, or until
+  the timeout expires. The check of the value and the sleeping happen 
+  atomically with respect to @c FutexWake, therefore, a thread which changes 
+  the futex and then calls @c FutexWake cannot miss a thread that is 
+  about to sleep.
+
+  @param addr The address of the futex.
+  @param expected The value that the futex must hold, for the thread to sleep.
+  @param timeout The time in milliseconds to sleep. A negative timeout means 
+     "infinite timeout".
+  @returns 0 if the thread was woken up by @c FutexWake, and -1 if the 
+    futex did not hold @c expected, or the timeout expired, or the thread 
+    woke up for other reasons.
+  @see FutexWake
+ */
+int FutexWait(int* addr, int expected, timeout_t timeout);
+
+/** @brief Wake up threads waiting on a futex.
+
+  Wake up at most @c n threads which wait on the futex at @c addr, 
+  in the order they started waiting.
+  This operation is non-blocking.
+
+  @param addr The address of the futex.
+  @param n The maximum number of threads to wake up.
+  @returns The number of threads woken up.
+  @see FutexWait
+ */
+int FutexWake(int* addr, int n);
+
+
 /*******************************************
  *
  * Process creation
@@ -291,6 +457,65 @@ Pid_t GetPid(void);
  */
 Pid_t GetPPid(void);
 
+/** @brief The default CPU weight of a process */
+#define CPU_WEIGHT_DEFAULT 100
+
+/** @brief The maximum CPU weight of a process */
+#define CPU_WEIGHT_MAX 10000
+
+/** @brief Set the CPU share of a process.
+
+  The CPU time of a process is shared among the process's threads. 
+  The weight determines the share of a process relative to the other
+  processes: under the fair scheduling policy (see @c set_sched_policy), 
+  the ready processes get CPU time in proportion to their weights, 
+  independently of how many threads they have. 
+
+  The quota is a hard limit to the CPU time of the process, in percent 
+  of the time of one core (e.g., 50 for half a core, 200 for two cores). 
+  The threads of a process which has exceeded its quota are not scheduled
+  until the end of the current accounting period (100 msec). The quota is
+  enforced under both policies. 
+
+  A new process inherits the weight and quota of its parent. 
+
+  @param pid the process, which must be the caller or a child of the caller
+  @param weight the weight, from 1 to @c CPU_WEIGHT_MAX
+  @param quota the quota in percent of a core, or 0 for no quota
+  @returns 0 on success, or -1 on error. Possible errors are:
+  - the process does not exist, or is not the caller or a child of the caller
+  - the weight or the quota is out of range
+ */
+int SetCpuShare(Pid_t pid, unsigned int weight, unsigned int quota);
+
+/** @brief The threads whose resource usage is returned by @c GetRUsage(). */
+typedef enum {
+  USAGE_PROCESS,  /**< @brief All the threads of the caller's process, past and present */
+  USAGE_THREAD,   /**< @brief The calling thread */
+  USAGE_CHILDREN  /**< @brief The terminated children of the caller's process that have been 
+                       waited for, with the children they had waited for, and so on */
+} usage_who;
+
+/** @brief Resource usage, as returned by @c GetRUsage(). 
+
+  Times are in microseconds, measured with a clock of microsecond resolution.
+ */
+typedef struct resource_usage {
+  unsigned long run_time;   /**< @brief The CPU time used */
+  unsigned long wait_time;  /**< @brief The time spent ready to run, waiting for a core */
+  unsigned long switches;   /**< @brief The number of times a thread was given a core */
+  unsigned long sleeps;     /**< @brief The number of times a thread gave up its core 
+                                 voluntarily (to block, or to yield) */
+} resource_usage;
+
+/** @brief Return the resource usage of threads.
+
+  @param who whose usage to return
+  @param usage the usage is stored here
+  @returns 0 on success, or -1 if @c who is not valid or @c usage is NULL
+ */
+int GetRUsage(usage_who who, resource_usage* usage);
+
 /*******************************************
  *
  * Threads
@@ -319,6 +544,35 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+/** 
+  @brief Create a new thread in the current process, with the given stack size.
+
+  This is the same as `CreateThread`, except that the size of the stack of the 
+  new thread, in bytes, is given. The stack memory is only committed as it is used,
+  so large numbers of threads that need little stack are cheap.
+  
+  @param task a function to execute
+  @param stack_size the size of the stack, which must be between 16 kbytes and 64 Mbytes
+  @returns the new thread id, or `NOTHREAD` if the stack size is not valid.
+  @see CreateThread
+  */
+Tid_t CreateThreadStack(Task task, int argl, void* args, unsigned int stack_size);
+
+/**
+  @brief Set the cores that a thread may run on.
+
+  The thread must belong to the current process. From now on, it will
+  only be scheduled on the cores in @c mask, and it will be moved to
+  one of them if needed. Cores in the mask that the machine does not 
+  have are ignored. By default, a thread may run on any core.
+
+  @param tid the thread id
+  @param mask the set of cores, e.g., `CPUMASK(0)|CPUMASK(2)` or `CPUMASK_ALL`
+  @returns 0 on success, or -1 if the thread is not valid or the mask 
+     contains no core of the machine.
+  */
+int SetThreadAffinity(Tid_t tid, cpumask_t mask);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -736,6 +990,13 @@ typedef struct procinfo
 
     If the task's argument is longer (as designated by the @c argl field), the
     bytes contained in this field are just the prefix.  */
+
+  unsigned long cpu_time; /**< @brief The CPU time used by the threads of the process, in usec */
+  unsigned long wait_time; /**< @brief The time the threads of the process waited for a core, in usec */
+  unsigned long switches; /**< @brief The number of times the threads of the process were given a core */
+  unsigned long sleeps; /**< @brief The number of times the threads of the process gave up a core voluntarily */
+  unsigned int cpu_weight; /**< @brief The CPU weight of the process, see @c SetCpuShare() */
+  unsigned int cpu_quota; /**< @brief The CPU quota of the process, or 0, see @c SetCpuShare() */
 } procinfo;
 
 
@@ -751,7 +1012,9 @@ typedef struct procinfo
 
 	There is no guarantee of the timeliness of the information.
 	A best-effort approach to return relevant system information is
-	made. 
+	made. The records are produced as they are read, in pid order, so
+	a process created or reaped while the stream is read may or may
+	not appear. Reading many records with each @c Read() is faster.
 
 	@returns a file id on success, or NOFILE on error. Possible reasons
 		for error are:
@@ -781,6 +1044,27 @@ Fid_t OpenInfo();
 void boot(unsigned int ncores, unsigned int terminals, Task boot_task, int argl, void* args);
 
 
+/** @brief The scheduling policies of the kernel.
+
+  @see set_sched_policy
+  */
+typedef enum {
+	SCHED_POLICY_MLFQ, /**< @brief Multi-level feedback queue (the default) */
+	SCHED_POLICY_FAIR  /**< @brief Fair share, threads are ordered by their virtual runtime */
+} sched_policy_t;
+
+/** @brief Select the scheduling policy.
+
+  The policy takes effect at the next call to @c boot() and cannot be changed
+  while tinyos is running. The default policy is @c SCHED_POLICY_MLFQ, unless
+  it is changed at compile time (@c -DSCHED_DEFAULT_POLICY=SCHED_POLICY_FAIR).
+
+  @param policy the policy for subsequent boots
+  @returns the previously selected policy
+  */
+sched_policy_t set_sched_policy(sched_policy_t policy);
+
+
 /** @} */
 
 #endif
@@ -21,6 +21,7 @@ int Repeat(size_t,const char**);
 int Hanoi(size_t,const char**);
 int HelpMessage(size_t,const char**);
 int SystemInfo(size_t,const char**);
+int ProcessStatus(size_t,const char**);
 int Capitalize(size_t,const char**);
 int LowerCase(size_t,const char**);
 int LineEnum(size_t,const char**);
@@ -39,6 +40,7 @@ COMMANDS[]  =
 	{"help", HelpMessage, 0, "A help message."},
 	{"ls", ListPrograms, 0, "List available programs programs."},
 	{"sysinfo", SystemInfo, 0, "Print some basic info about the current system."},
+	{"ps", ProcessStatus, 0, "List the processes, with their threads, CPU usage and arguments."},
 	{"runterm", RunTerm, 2, "runterm <term> <prog>  <args...> : execute '<prog> <args...>' on terminal <term>."},
 	{"sh", Shell, 0, "Run a shell."},
 	{"repeat", Repeat, 2, "repeat <n> <prog> <args...>: execute '<prog> <args...>' <n> times."},
@@ -168,37 +170,58 @@ int SystemInfo(size_t argc, const char** argv)
 {
 	printf("Number of cores         = %d\n", cpu_cores());
 	printf("Number of serial devices= %d\n", bios_serial_ports());
+	printf("\n");
+	return ProcessStatus(0, NULL);
+}
+
+
+int ProcessStatus(size_t argc, const char** argv)
+{
 	Fid_t finfo = OpenInfo();
-	if(finfo!=NOFILE) {
-		/* Print per-process info */
-		procinfo info;
-		printf("%5s %5s %6s %8s %20s\n",
-			"PID", "PPID", "State", "Threads", "Main program"
-			);
-		/* Read in next piece of info */		
-		while(Read(finfo, (char*) &info, sizeof(info)) > 0) {
-			Program prog=NULL;
-			const char* argv[10];
-			int argc = ParseProcInfo(&info, &prog, 10, argv);
-
-			const char* pname = "-";
-			if(argc>=1)  {
-				pname = argv[0];
-			} else if(argc==-1) {
-				/* Try to give some known names */
-				if(info.pid==1) pname = "init";
-			}
+	if(finfo==NOFILE) {
+		printf("Cannot open the info stream\n");
+		return 1;
+	}
 
-			printf("%5d %5d %6s %8u %20s\n",
-				info.pid,
-				info.ppid,
-				(info.alive?"ALIVE":"ZOMBIE"),
-				info.thread_count,
-				pname
+	printf("%5s %5s %6s %8s %10s %10s %8s %6s %6s  %s\n",
+		"PID", "PPID", "State", "Threads", "CPU(msec)", "Wait(msec)", "Switches", "Weight", "Quota", "Command"
+		);
+
+	/* Read many records at a time */
+	procinfo info[16];
+	int rc;
+	while((rc = Read(finfo, (char*) info, sizeof(info))) > 0) {
+		for(int i=0; i < rc / (int)sizeof(procinfo); i++) {
+			procinfo* p = &info[i];
+			const char* pargv[8];
+			int pargc = ParseProcInfo(p, NULL, 8, pargv);
+
+			printf("%5d %5d %6s %8lu %10lu %10lu %8lu %6u %5u%%  ",
+				p->pid,
+				p->ppid,
+				(p->alive?"ALIVE":"ZOMBIE"),
+				p->thread_count,
+				p->cpu_time / 1000,
+				p->wait_time / 1000,
+				p->switches,
+				p->cpu_weight,
+				p->cpu_quota
 				);
+
+			if(pargc >= 1) {
+				for(int a=0; a < pargc && a < 8; a++)
+					printf("%s ", pargv[a]);
+				if(pargc > 8) printf("...");
+			} else if(p->pid==0)
+				printf("idle");
+			else if(p->pid==1)
+				printf("init");
+			else
+				printf("-");
+			printf("\n");
 		}
 	}
-	printf("\n");
+	Close(finfo);
 	return 0;
 }
 
@@ -424,6 +447,7 @@ struct __rs_globals
 	/* used to log connection messages */
 	rlnode log;
 	size_t logcount;
+	RWLock log_lock;
 	
 	/* Synchronize with active threads */
 	Mutex mx;
@@ -576,15 +600,16 @@ static void log_message(void* __globals, const char* msg, ...)
 
 	/* Append the record */
 	logrec *rec = (logrec*) buffer;
-	Mutex_Lock(& GS(mx));
+	RWLock_WriteLock(& GS(log_lock));
 	rlnode_new(& rec->node)->num = ++GS(logcount);
 	rlist_push_back(& GS(log), & rec->node);
-	Mutex_Unlock(& GS(mx));
+	RWLock_WriteUnlock(& GS(log_lock));
 }
 
 /* init the log */
 static void log_init(void* __globals)
 {
+	GS(log_lock) = RWLOCK_INIT;
 	rlnode_init(& GS(log), NULL);
 	GS(logcount)=0;
 }
@@ -592,12 +617,12 @@ static void log_init(void* __globals)
 /* Print the log to the console */
 static void log_print(void* __globals)
 {
-	Mutex_Lock(& GS(mx));
+	RWLock_ReadLock(& GS(log_lock));
 	for(rlnode* ptr = GS(log).next; ptr != &GS(log); ptr=ptr->next) {
 		logrec *rec = (logrec*)ptr;
 		printf("%6d: %s\n", rec->node.num, rec->message);
 	}
-	Mutex_Unlock(& GS(mx));
+	RWLock_ReadUnlock(& GS(log_lock));
 }
 
 	
@@ -607,9 +632,9 @@ static void log_truncate(void* __globals)
 	rlnode list;
 	rlnode_init(&list, NULL);
 	
-	Mutex_Lock(& GS(mx));
+	RWLock_WriteLock(& GS(log_lock));
 	rlist_append(& list, &GS(log));
-	Mutex_Unlock(& GS(mx));
+	RWLock_WriteUnlock(& GS(log_lock));
 
 	/* Free the memory ! */
 	while(list.next != &list) {
@@ -125,16 +125,19 @@ int ParseProcInfo(procinfo* pinfo, Program* prog, int argc, const char** argv )
 	int argl = pinfo->argl;
 	void* args = pinfo->args;
 
+	if(argl < (int)sizeof(Program))
+		return -1;
+
 	/* unpack the program pointer */
-	if(prog) memcpy(&prog, args, sizeof(prog));
+	if(prog) memcpy(prog, args, sizeof(Program));
 
-	argl -= sizeof(Program*);
-	args += sizeof(Program*);
+	argl -= sizeof(Program);
+	args += sizeof(Program);
 
 	/* unpack the string vector */
 	size_t N = argscount(argl, args);
 	if(argv) {
-		if(argc>N)
+		if(argc > (int)N)
 			argc = N;
 		argvunpack(argc, argv, argl, args);
 	}
@@ -2136,11 +2136,1150 @@ BARE_TEST(dummy_user_test,
 }
 
 
+BOOT_TEST(test_many_timed_waits,
+	"Test that many threads sleeping with different timeouts, some of them longer\n"
+	"than a turn of the scheduler's timing wheel, all wake up after their timeout."
+	)
+{
+	const int N = 200;
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	CondVar done_cv = COND_INIT;
+	int early = 0, done = 0;
+
+	unsigned long tspec2msec(struct timespec t)
+	{
+		return 1000ul*t.tv_sec + t.tv_nsec/1000000ul;
+	}
+
+	int sleeper(int argl, void* args)
+	{
+		/* Timeouts between 100 and 3085 msec */
+		timeout_t t = 100 + 15*argl;
+		struct timespec t1, t2;
+		clock_gettime(CLOCK_REALTIME, &t1);
+
+		Mutex_Lock(&mx);
+		Cond_TimedWait(&mx, &cv, t);
+		clock_gettime(CLOCK_REALTIME, &t2);
+		/* Allow for the coarse resolution of the clock */
+		if(tspec2msec(t2)-tspec2msec(t1) + 20 < t) early++;
+		done++;
+		Cond_Signal(&done_cv);
+		Mutex_Unlock(&mx);
+		return 0;
+	}
+
+	for(int i=0; i<N; i++)
+		ASSERT(CreateThread(sleeper, i, NULL) != NOTHREAD);
+
+	/* Wait for all sleepers, before leaving the current stack frame */
+	Mutex_Lock(&mx);
+	while(done < N) Cond_Wait(&mx, &done_cv);
+	Mutex_Unlock(&mx);
+
+	ASSERT(early == 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_create_thread_stack,
+	"Test that threads can be created with a given stack size, and that\n"
+	"many threads with small stacks can coexist."
+	)
+{
+	const int N = 2000;
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	int count = 0, go = 0;
+
+	int deep(int n) { 
+		volatile char buf[1024];
+		buf[0] = n;
+		return (n==0) ? buf[0] : deep(n-1)+buf[0]; 
+	}
+
+	int waiter(int argl, void* args)
+	{
+		Mutex_Lock(&mx);
+		count++;
+		Cond_Broadcast(&cv);
+		while(!go) Cond_Wait(&mx, &cv);
+		count--;
+		Cond_Broadcast(&cv);
+		Mutex_Unlock(&mx);
+		return 0;
+	}
+
+	int big_user(int argl, void* args)
+	{
+		/* Use about 1 Mbyte of stack */
+		deep(1000);
+		return waiter(argl, args);
+	}
+
+	ASSERT(CreateThreadStack(waiter, 0, NULL, 1024) == NOTHREAD);
+	ASSERT(CreateThreadStack(waiter, 0, NULL, 1u<<30) == NOTHREAD);
+
+	ASSERT(CreateThreadStack(big_user, 0, NULL, 2u<<20) != NOTHREAD);
+	for(int i=1; i<N; i++)
+		ASSERT(CreateThreadStack(waiter, 0, NULL, 16*1024) != NOTHREAD);
+
+	/* Wait for all threads to start, then release them and wait for them to exit */
+	Mutex_Lock(&mx);
+	while(count < N) Cond_Wait(&mx, &cv);
+	go = 1;
+	Cond_Broadcast(&cv);
+	while(count > 0) Cond_Wait(&mx, &cv);
+	Mutex_Unlock(&mx);
+
+	return 0;
+}
+
+
+BOOT_TEST(test_thread_affinity,
+	"Test that threads only run on the cores allowed by their affinity."
+	)
+{
+	const int N = 8;
+	uint ncores = cpu_cores();
+	int wrong_core = 0, go = 0;
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	int pinned(int argl, void* args)
+	{
+		Mutex_Lock(&mx);
+		while(!go) Cond_Wait(&mx, &cv);
+		Mutex_Unlock(&mx);
+
+		/* Run for a while, so that preemption happens */
+		for(int i=0; i<100; i++) {
+			if(cpu_core_id != (uint)argl) 
+				__atomic_fetch_add(&wrong_core, 1, __ATOMIC_RELAXED);
+			fibo(20);
+		}
+		return 0;
+	}
+
+	int self_pinned(int argl, void* args)
+	{
+		ASSERT(SetThreadAffinity(ThreadSelf(), CPUMASK(argl)) == 0);
+		return pinned(argl, args);
+	}
+
+	/* Invalid arguments */
+	ASSERT(SetThreadAffinity(NOTHREAD, CPUMASK_ALL) == -1);
+	ASSERT(SetThreadAffinity(ThreadSelf(), CPUMASK(ncores)) == -1);
+
+	Tid_t tids[2*N];
+	for(int i=0; i<N; i++) {
+		uint core = i % ncores;
+		tids[i] = CreateThread(pinned, core, NULL);
+		ASSERT(SetThreadAffinity(tids[i], CPUMASK(core)) == 0);
+		tids[N+i] = CreateThread(self_pinned, core, NULL);
+	}
+
+	Mutex_Lock(&mx);
+	go = 1;
+	Cond_Broadcast(&cv);
+	Mutex_Unlock(&mx);
+
+	for(int i=0; i<2*N; i++)
+		ThreadJoin(tids[i], NULL);
+
+	ASSERT(wrong_core == 0);
+	return 0;
+}
+
+
+BARE_TEST(test_fair_policy,
+	"Test that, with the fair scheduling policy, CPU-bound threads share\n"
+	"a core evenly."
+	)
+{
+	enum { N = 4 };
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	volatile int stop = 0;
+	int running = 0;
+	unsigned long work[N];
+
+	int hog(int argl, void* args)
+	{
+		while(!stop) {
+			fibo(15);
+			work[argl]++;
+		}
+		Mutex_Lock(&mx);
+		running--;
+		Cond_Broadcast(&cv);
+		Mutex_Unlock(&mx);
+		return 0;
+	}
+
+	int boot_task(int argl, void* args)
+	{
+		running = N;
+		for(int i=0; i<N; i++) {
+			work[i] = 0;
+			ASSERT(CreateThread(hog, i, NULL) != NOTHREAD);
+		}
+
+		/* Let the hogs run for a few quanta */
+		Mutex_Lock(&mx);
+		Cond_TimedWait(&mx, &cv, 300);
+		stop = 1;
+		while(running > 0) Cond_Wait(&mx, &cv);
+		Mutex_Unlock(&mx);
+		return 0;
+	}
+
+	sched_policy_t old = set_sched_policy(SCHED_POLICY_FAIR);
+	boot(1, 0, boot_task, 0, NULL);
+	set_sched_policy(old);
+
+	unsigned long wmax = 0;
+	for(int i=0; i<N; i++)
+		if(work[i] > wmax) wmax = work[i];
+	for(int i=0; i<N; i++)
+		ASSERT_MSG(4*work[i] >= wmax, "hog %d did %lu units of work, the max is %lu\n", i, work[i], wmax);
+}
+
+
+/* Return the procinfo of a process, read from the info stream */
+static int get_procinfo(Pid_t pid, procinfo* pinfo)
+{
+	Fid_t finfo = OpenInfo();
+	if(finfo == NOFILE) return 0;
+	int found = 0;
+	while(!found && Read(finfo, (char*) pinfo, sizeof(procinfo)) == sizeof(procinfo))
+		found = (pinfo->pid == pid);
+	Close(finfo);
+	return found;
+}
+
+
+BOOT_TEST(test_cpu_share,
+	"Test that SetCpuShare checks its arguments, and that the CPU share\n"
+	"of a process is reported by the info stream and inherited by children."
+	)
+{
+	procinfo info;
+	Pid_t self = GetPid();
+
+	ASSERT(get_procinfo(self, &info));
+	ASSERT(info.cpu_weight == CPU_WEIGHT_DEFAULT);
+	ASSERT(info.cpu_quota == 0);
+
+	ASSERT(SetCpuShare(NOPROC, CPU_WEIGHT_DEFAULT, 0) == -1);
+	ASSERT(SetCpuShare(MAX_PROC, CPU_WEIGHT_DEFAULT, 0) == -1);
+	ASSERT(SetCpuShare(self, 0, 0) == -1);
+	ASSERT(SetCpuShare(self, CPU_WEIGHT_MAX+1, 0) == -1);
+	ASSERT(SetCpuShare(self, CPU_WEIGHT_DEFAULT, 100*cpu_cores()+1) == -1);
+	/* pid 0 is not our child */
+	ASSERT(SetCpuShare(0, CPU_WEIGHT_DEFAULT, 0) == -1);
+
+	ASSERT(SetCpuShare(self, 50, 30) == 0);
+	ASSERT(get_procinfo(self, &info));
+	ASSERT(info.cpu_weight == 50);
+	ASSERT(info.cpu_quota == 30);
+
+	int child(int argl, void* args) { 
+		procinfo cinfo;
+		ASSERT(get_procinfo(GetPid(), &cinfo));
+		ASSERT(cinfo.cpu_weight == 50);
+		ASSERT(cinfo.cpu_quota == 30);
+		return 0; 
+	}
+	Pid_t cpid = Exec(child, 0, NULL);
+	ASSERT(cpid != NOPROC);
+	WaitChild(cpid, NULL);
+
+	ASSERT(SetCpuShare(self, CPU_WEIGHT_DEFAULT, 0) == 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_cpu_quota,
+	"Test that a process with a CPU quota does not use more CPU time than its quota."
+	)
+{
+	volatile int stop = 0;
+	int hog(int argl, void* args) {
+		while(!stop) fibo(15);
+		return 0;
+	}
+
+	Pid_t cpid = Exec(hog, 0, NULL);
+	ASSERT(cpid != NOPROC);
+	ASSERT(SetCpuShare(cpid, CPU_WEIGHT_DEFAULT, 20) == 0);
+
+	/* Let the child run for a while */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	struct timeval t0;
+	mark_time(&t0);
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 500);
+	Mutex_Unlock(&mx);
+	double elapsed = time_since(&t0);
+
+	procinfo info;
+	ASSERT(get_procinfo(cpid, &info));
+	stop = 1;
+	WaitChild(cpid, NULL);
+
+	/* 
+		20% of each accounting period (100 msec) that the time touches, 
+		the first and the last partly, plus a quantum or two of overrun 
+	*/
+	ASSERT(info.cpu_time > 0);
+	ASSERT_MSG(info.cpu_time <= (1E6 * elapsed + 100000) * 0.2 + 30000, 
+		"cpu time %lu usec in %.3f sec\n", info.cpu_time, elapsed);
+	return 0;
+}
+
+
+BOOT_TEST(test_cpu_quota_lock_holder,
+	"Test that a process over its CPU quota is not throttled while it holds a\n"
+	"lock that another process waits for."
+	)
+{
+	Mutex mx = MUTEX_INIT;
+	volatile int stop = 0;
+
+	void sleep_for(timeout_t msec) {
+		Mutex wmx = MUTEX_INIT;
+		CondVar cv = COND_INIT;
+		Mutex_Lock(&wmx);
+		Cond_TimedWait(&wmx, &cv, msec);
+		Mutex_Unlock(&wmx);
+	}
+
+	/* Holds the lock for 5 msec at a time, using far more than its quota */
+	int holder(int argl, void* args) {
+		while(!stop) {
+			struct timeval t;
+			Mutex_Lock(&mx);
+			mark_time(&t);
+			while(time_since(&t) < 0.005);
+			Mutex_Unlock(&mx);
+			sleep_for(1);
+		}
+		return 0;
+	}
+
+	Pid_t cpid = Exec(holder, 0, NULL);
+	ASSERT(cpid != NOPROC);
+	ASSERT(SetCpuShare(cpid, CPU_WEIGHT_DEFAULT, 10) == 0);
+
+	/* A throttled holder would keep us waiting until the next quota period */
+	double maxwait = 0.0;
+	struct timeval t0;
+	mark_time(&t0);
+	while(time_since(&t0) < 1.0) {
+		struct timeval t;
+		mark_time(&t);
+		Mutex_Lock(&mx);
+		double wait = time_since(&t);
+		Mutex_Unlock(&mx);
+		if(wait > maxwait) maxwait = wait;
+		sleep_for(2);
+	}
+
+	stop = 1;
+	WaitChild(cpid, NULL);
+
+	ASSERT_MSG(maxwait < 0.05, "waited %.3f sec for the lock\n", maxwait);
+	return 0;
+}
+
+BARE_TEST(test_fair_share_processes,
+	"Test that, with the fair scheduling policy, processes share the CPU\n"
+	"regardless of the number of their threads."
+	)
+{
+	volatile int stop = 0;
+	unsigned long cpu_many = 0, cpu_one = 0;
+
+	int hog(int argl, void* args) {
+		while(!stop) fibo(15);
+		return 0;
+	}
+
+	int hog_process(int argl, void* args) {
+		for(int i=1; i<argl; i++)
+			CreateThread(hog, 0, NULL);
+		return hog(0, NULL);
+	}
+
+	int boot_task(int argl, void* args)
+	{
+		Pid_t many = Exec(hog_process, 8, NULL);
+		Pid_t one = Exec(hog_process, 1, NULL);
+
+		Mutex mx = MUTEX_INIT;
+		CondVar cv = COND_INIT;
+		Mutex_Lock(&mx);
+		Cond_TimedWait(&mx, &cv, 500);
+		Mutex_Unlock(&mx);
+
+		procinfo info;
+		ASSERT(get_procinfo(many, &info));
+		cpu_many = info.cpu_time;
+		ASSERT(get_procinfo(one, &info));
+		cpu_one = info.cpu_time;
+
+		stop = 1;
+		while(WaitChild(NOPROC, NULL) != NOPROC);
+		return 0;
+	}
+
+	sched_policy_t old = set_sched_policy(SCHED_POLICY_FAIR);
+	boot(1, 0, boot_task, 0, NULL);
+	set_sched_policy(old);
+
+	/* Without process fair share, the single thread would get 1/9 of the CPU */
+	ASSERT_MSG(3*cpu_one >= cpu_many, "8 threads: %lu usec, 1 thread: %lu usec\n", cpu_many, cpu_one);
+}
+
+
+
+BOOT_TEST(test_cond_handoff,
+	"Test that threads which signal and then block hand off the core to the\n"
+	"woken thread, ahead of other threads they woke up before, and that they\n"
+	"exchange a token correctly, next to a CPU-bound thread."
+	)
+{
+	const int ROUNDS = 2000;
+	Mutex mx = MUTEX_INIT;
+	CondVar cv[2] = { COND_INIT, COND_INIT };
+	CondVar poke = COND_INIT, exited = COND_INIT;
+	int turn = 0, passes = 0, handoffs = 0, running = 4;
+	int bystander_ran = 0;
+	volatile int stop = 0;
+
+	void done() {
+		Mutex_Lock(&mx);
+		running--;
+		Cond_Broadcast(&exited);
+		Mutex_Unlock(&mx);
+	}
+
+	/* 
+		Each player first wakes up the bystander, then the other player, and
+		blocks. Both are queued on the same core, the bystander first, but 
+		the handoff lets the other player run first.
+	 */
+	int player(int i, void* args) {
+		ASSERT(SetThreadAffinity(ThreadSelf(), CPUMASK(0)) == 0);
+		Mutex_Lock(&mx);
+		for(int r=0; r<ROUNDS; r++) {
+			while(turn != i) Cond_Wait(&mx, &cv[i]);
+			if(r > 0 || i == 1) {
+				if(! bystander_ran) handoffs++;
+			}
+			passes++;
+			turn = 1-i;
+			bystander_ran = 0;
+			Cond_Signal(&poke);
+			Cond_Signal(&cv[1-i]);
+		}
+		stop = 1;
+		Cond_Signal(&poke);
+		Mutex_Unlock(&mx);
+		done();
+		return 0;
+	}
+
+	int bystander(int argl, void* args) {
+		ASSERT(SetThreadAffinity(ThreadSelf(), CPUMASK(0)) == 0);
+		Mutex_Lock(&mx);
+		while(!stop) {
+			bystander_ran = 1;
+			Cond_Wait(&mx, &poke);
+		}
+		Mutex_Unlock(&mx);
+		done();
+		return 0;
+	}
+
+	int hog(int argl, void* args) {
+		while(!stop) fibo(15);
+		done();
+		return 0;
+	}
+
+	ASSERT(CreateThread(hog, 0, NULL) != NOTHREAD);
+	ASSERT(CreateThread(bystander, 0, NULL) != NOTHREAD);
+	ASSERT(CreateThread(player, 0, NULL) != NOTHREAD);
+	ASSERT(CreateThread(player, 1, NULL) != NOTHREAD);
+
+	Mutex_Lock(&mx);
+	while(running > 0) Cond_Wait(&mx, &exited);
+	Mutex_Unlock(&mx);
+
+	ASSERT(passes == 2*ROUNDS);
+	/* A few handoffs may be lost, e.g., when the quantum expires */
+	ASSERT_MSG(handoffs >= 2*ROUNDS*9/10, "%d handoffs in %d passes\n", handoffs, passes);
+	return 0;
+}
+
+
+BOOT_TEST(test_cond_broadcast_morph,
+	"Test that the waiters of a broadcast, which are moved to the queue of\n"
+	"the mutex, all get the mutex one at a time, including waiters with a timeout."
+	)
+{
+	const int N = 10, ROUNDS = 200;
+	Mutex mx = MUTEX_INIT;
+	CondVar go = COND_INIT, seen_all = COND_INIT;
+	int round = 0, seen = 0, running = N;
+	volatile int inside = 0;
+	int overlaps = 0;
+
+	int waiter(int i, void* args) {
+		Mutex_Lock(&mx);
+		for(int r=1; r<=ROUNDS; r++) {
+			while(round < r) {
+				if(i % 2) Cond_TimedWait(&mx, &go, 1);
+				else Cond_Wait(&mx, &go);
+			}
+			/* Check that we own the mutex alone */
+			if(inside++) overlaps++;
+			fibo(5);
+			inside--;
+			if(++seen == N) Cond_Signal(&seen_all);
+		}
+		running--;
+		Cond_Signal(&seen_all);
+		Mutex_Unlock(&mx);
+		return 0;
+	}
+
+	for(int i=0; i<N; i++)
+		ASSERT(CreateThread(waiter, i, NULL) != NOTHREAD);
+
+	Mutex_Lock(&mx);
+	for(int r=1; r<=ROUNDS; r++) {
+		seen = 0;
+		round = r;
+		Cond_Broadcast(&go);
+		fibo(10);
+		while(seen < N) Cond_Wait(&mx, &seen_all);
+	}
+	while(running > 0) Cond_Wait(&mx, &seen_all);
+	Mutex_Unlock(&mx);
+
+	ASSERT(overlaps == 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_mutex_sleep,
+	"Test that threads blocked on a mutex sleep instead of using the CPU, and\n"
+	"that they all get the mutex when it is unlocked."
+	)
+{
+	const int N = 8;
+	Mutex mx = MUTEX_INIT;
+	CondVar done = COND_INIT;
+	int count = 0;
+
+	int contender(int argl, void* args) {
+		Mutex_Lock(&mx);
+		count++;
+		Cond_Signal(&done);
+		Mutex_Unlock(&mx);
+		return 0;
+	}
+
+	/* The contenders run in a child process, whose CPU time we can read */
+	int child(int argl, void* args) {
+		for(int i=0; i<N; i++)
+			CreateThread(contender, 0, NULL);
+		Mutex_Lock(&mx);
+		while(count < N) Cond_Wait(&mx, &done);
+		Mutex_Unlock(&mx);
+		return 0;
+	}
+
+	Mutex_Lock(&mx);
+	Pid_t cpid = Exec(child, 0, NULL);
+	ASSERT(cpid != NOPROC);
+
+	/* Hold the mutex for a while */
+	Mutex wmx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&wmx);
+	Cond_TimedWait(&wmx, &cv, 300);
+	Mutex_Unlock(&wmx);
+
+	procinfo info;
+	ASSERT(get_procinfo(cpid, &info));
+	ASSERT(count == 0);
+	Mutex_Unlock(&mx);
+	WaitChild(cpid, NULL);
+
+	ASSERT(count == N);
+	/* A spinning (or yielding) mutex would use all of the 300 msec */
+	ASSERT_MSG(info.cpu_time < 30000, "cpu time %lu usec\n", info.cpu_time);
+	return 0;
+}
+
+
+
+BARE_TEST(test_mutex_owner_exits,
+	"Test that a thread which blocks on a mutex, whose owner has exited without\n"
+	"unlocking it, does not lend its priority to the thread which reuses the TCB\n"
+	"of the owner."
+	)
+{
+	Mutex mx = MUTEX_INIT;
+	volatile int stop = 0;
+	volatile unsigned long work[3] = { 0, 0, 0 };
+	unsigned long work0 = 0;
+
+	int grab(int argl, void* args) { Mutex_Lock(&mx); return 0; }
+	int waiter(int argl, void* args) { Mutex_Lock(&mx); Mutex_Unlock(&mx); return 0; }
+	int hog(int i, void* args) {
+		while(!stop) { fibo(10); work[i]++; }
+		return 0;
+	}
+
+	void sleep_for(timeout_t msec) {
+		Mutex wmx = MUTEX_INIT;
+		CondVar cv = COND_INIT;
+		Mutex_Lock(&wmx);
+		Cond_TimedWait(&wmx, &cv, msec);
+		Mutex_Unlock(&wmx);
+	}
+
+	int boot_task(int argl, void* args)
+	{
+		/* The owner exits holding the mutex */
+		Tid_t t = CreateThread(grab, 0, NULL);
+		ASSERT(ThreadJoin(t, NULL) == 0);
+
+		/* The first hog gets the recycled TCB, and drops to the lowest level */
+		Tid_t h[3];
+		h[0] = CreateThread(hog, 0, NULL);
+		sleep_for(100);
+
+		/* The waiter must not boost the first hog above the others */
+		Tid_t w = CreateThread(waiter, 0, NULL);
+		sleep_for(20);
+		work0 = work[0];
+		h[1] = CreateThread(hog, 1, NULL);
+		h[2] = CreateThread(hog, 2, NULL);
+		sleep_for(300);
+		work0 = work[0] - work0;
+
+		stop = 1;
+		Mutex_Unlock(&mx);
+		ASSERT(ThreadJoin(w, NULL) == 0);
+		for(int i=0; i<3; i++)
+			ASSERT(ThreadJoin(h[i], NULL) == 0);
+		return 0;
+	}
+
+	sched_policy_t old = set_sched_policy(SCHED_POLICY_MLFQ);
+	boot(1, 0, boot_task, 0, NULL);
+	set_sched_policy(old);
+
+	/* 
+		A preempted thread always yields to the head of the run queue, so a 
+		boosted hog would run every other quantum, twice as much as each of the others.
+	 */
+	ASSERT_MSG(4*work0 < 3*(work[1]+work[2]), "hogs: %lu %lu %lu\n", work0, work[1], work[2]);
+}
+
+
+BOOT_TEST(test_io_close_while_in_use,
+	"Test that a stream which is closed or replaced (with Dup2) by one thread,\n"
+	"while other threads read and write it, stays usable until they are done."
+	)
+{
+	const int N = 4, ROUNDS = 2000;
+	Fid_t fid = OpenNull();
+	ASSERT(fid != NOFILE);
+	int running = N, errors = 0;
+	Mutex mx = MUTEX_INIT;
+	CondVar exited = COND_INIT;
+
+	int user(int argl, void* args) {
+		char buf[16];
+		int bad = 0;
+		for(int r=0; r<ROUNDS; r++) {
+			int rr = Read(fid, buf, sizeof(buf));
+			int wr = Write(fid, buf, sizeof(buf));
+			/* The fid may be closed at any time, but never half-open */
+			if((rr != -1 && rr != sizeof(buf)) || (wr != -1 && wr != sizeof(buf)))
+				bad++;
+		}
+		Mutex_Lock(&mx);
+		errors += bad;
+		running--;
+		Cond_Signal(&exited);
+		Mutex_Unlock(&mx);
+		return 0;
+	}
+
+	for(int i=0; i<N; i++)
+		ASSERT(CreateThread(user, i, NULL) != NOTHREAD);
+
+	/* Keep replacing and closing the stream of fid */
+	Fid_t other = OpenNull();
+	ASSERT(other != NOFILE);
+	for(int r=0; r<ROUNDS; r++) {
+		ASSERT(Dup2(other, fid) == 0);
+		ASSERT(Close(fid) == 0);
+		Fid_t f = OpenNull();
+		ASSERT(f != NOFILE);
+		if(f != fid) {
+			ASSERT(Dup2(f, fid) == 0);
+			ASSERT(Close(f) == 0);
+		}
+	}
+
+	Mutex_Lock(&mx);
+	while(running > 0) Cond_Wait(&mx, &exited);
+	Mutex_Unlock(&mx);
+
+	ASSERT(errors == 0);
+	ASSERT(Close(fid) == 0);
+	ASSERT(Close(other) == 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_rwlock,
+	"Test that readers of an RWLock hold it together, that writers hold it alone,\n"
+	"and that a writer is not starved by readers which keep coming."
+	)
+{
+	const int N = 6, ROUNDS = 2000;
+	RWLock rw = RWLOCK_INIT;
+	Semaphore sem = SEM_INIT(0), met[2] = { SEM_INIT(0), SEM_INIT(0) };
+	Mutex mx = MUTEX_INIT;
+	CondVar exited = COND_INIT;
+	int readers = 0, writers = 0, errors = 0, running = 0, stop = 0;
+
+	/* Two readers which need each other: this only works if they hold the lock together */
+	int pair(int argl, void* args) {
+		RWLock_ReadLock(&rw);
+		Sem_Up(&met[argl]);
+		Sem_Down(&met[1-argl]);
+		RWLock_ReadUnlock(&rw);
+		Sem_Up(&sem);
+		return 0;
+	}
+	ASSERT(CreateThread(pair, 0, NULL) != NOTHREAD);
+	ASSERT(CreateThread(pair, 1, NULL) != NOTHREAD);
+	Sem_Down(&sem);
+	Sem_Down(&sem);
+
+	int user(int argl, void* args) {
+		int bad = 0;
+		for(int r=0; r<ROUNDS; r++) {
+			if(argl) {
+				RWLock_WriteLock(&rw);
+				if(__atomic_add_fetch(&writers, 1, __ATOMIC_RELAXED) != 1 || readers != 0) bad++;
+				__atomic_sub_fetch(&writers, 1, __ATOMIC_RELAXED);
+				RWLock_WriteUnlock(&rw);
+			} else {
+				RWLock_ReadLock(&rw);
+				__atomic_add_fetch(&readers, 1, __ATOMIC_RELAXED);
+				if(writers != 0) bad++;
+				__atomic_sub_fetch(&readers, 1, __ATOMIC_RELAXED);
+				RWLock_ReadUnlock(&rw);
+			}
+		}
+		Mutex_Lock(&mx);
+		errors += bad;
+		running--;
+		Cond_Signal(&exited);
+		Mutex_Unlock(&mx);
+		return 0;
+	}
+
+	running = N;
+	for(int i=0; i<N; i++)
+		ASSERT(CreateThread(user, i%3==0, NULL) != NOTHREAD);
+	Mutex_Lock(&mx);
+	while(running > 0) Cond_Wait(&mx, &exited);
+	Mutex_Unlock(&mx);
+	ASSERT(errors == 0);
+
+	/* Readers keep the lock always held, but the writer gets in */
+	int reader(int argl, void* args) {
+		while(! __atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+			RWLock_ReadLock(&rw);
+			for(volatile int i=0; i<1000; i++);
+			RWLock_ReadUnlock(&rw);
+		}
+		Sem_Up(&sem);
+		return 0;
+	}
+	for(int i=0; i<3; i++)
+		ASSERT(CreateThread(reader, 0, NULL) != NOTHREAD);
+	RWLock_WriteLock(&rw);
+	stop = 1;
+	RWLock_WriteUnlock(&rw);
+	for(int i=0; i<3; i++)
+		Sem_Down(&sem);
+	ASSERT(! Sem_TryDown(&sem));
+	return 0;
+}
+
+
+BOOT_TEST(test_semaphore,
+	"Test a bounded buffer made of semaphores, with many producers and consumers."
+	)
+{
+	enum { SIZE = 4, N = 3, ITEMS = 1000 };
+	int buffer[SIZE], in = 0, out = 0;
+	Semaphore slots = SEM_INIT(SIZE), items = SEM_INIT(0), finished = SEM_INIT(0);
+	Mutex mx = MUTEX_INIT;
+	long sum = 0;
+
+	int producer(int argl, void* args) {
+		for(int i=1; i<=ITEMS; i++) {
+			Sem_Down(&slots);
+			Mutex_Lock(&mx);
+			buffer[in++ % SIZE] = i;
+			Mutex_Unlock(&mx);
+			Sem_Up(&items);
+		}
+		Sem_Up(&finished);
+		return 0;
+	}
+
+	int consumer(int argl, void* args) {
+		for(int i=1; i<=ITEMS; i++) {
+			Sem_Down(&items);
+			Mutex_Lock(&mx);
+			sum += buffer[out++ % SIZE];
+			Mutex_Unlock(&mx);
+			Sem_Up(&slots);
+		}
+		Sem_Up(&finished);
+		return 0;
+	}
+
+	for(int i=0; i<N; i++) {
+		ASSERT(CreateThread(producer, 0, NULL) != NOTHREAD);
+		ASSERT(CreateThread(consumer, 0, NULL) != NOTHREAD);
+	}
+	for(int i=0; i<2*N; i++)
+		Sem_Down(&finished);
+
+	ASSERT(sum == (long) N * ITEMS * (ITEMS+1) / 2);
+	ASSERT(! Sem_TryDown(&items));
+	ASSERT(Sem_TryDown(&slots) && slots.count == SIZE-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_futex,
+	"Test FutexWait and FutexWake, by building a lock out of a futex (a lock which\n"
+	"only makes system calls when it is contended), and using it from many threads."
+	)
+{
+	int fx = 0;
+
+	/* Waiting fails at once for the wrong value, and at the timeout for the right one */
+	ASSERT(FutexWait(&fx, 1, 100) == -1);
+	ASSERT(FutexWait(&fx, 0, 50) == -1);
+	ASSERT(FutexWake(&fx, 1) == 0);
+
+	/* The lock: 0 is unlocked, 1 is locked, 2 is locked with waiters */
+	int lock = 0;
+	void futex_lock() {
+		int c = 0;
+		if(__atomic_compare_exchange_n(&lock, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+		while(__atomic_exchange_n(&lock, 2, __ATOMIC_ACQUIRE) != 0)
+			FutexWait(&lock, 2, -1);
+	}
+	void futex_unlock() {
+		if(__atomic_exchange_n(&lock, 0, __ATOMIC_RELEASE) == 2)
+			FutexWake(&lock, 1);
+	}
+
+	const int N = 6, ROUNDS = 3000;
+	int count = 0, inside = 0, errors = 0, running = N;
+
+	int user(int argl, void* args) {
+		Mutex mx = MUTEX_INIT;
+		CondVar cv = COND_INIT;
+		for(int r=0; r<ROUNDS; r++) {
+			futex_lock();
+			if(inside++ != 0) errors++;
+			count++;
+			/* Sleep while holding the lock, now and then, so that others wait */
+			if(r % 100 == 0) {
+				Mutex_Lock(&mx);
+				Cond_TimedWait(&mx, &cv, 1);
+				Mutex_Unlock(&mx);
+			}
+			inside--;
+			futex_unlock();
+		}
+		futex_lock();
+		running--;
+		futex_unlock();
+		/* Wake up the main thread, waiting on the futex below */
+		__atomic_add_fetch(&fx, 1, __ATOMIC_RELEASE);
+		FutexWake(&fx, 1);
+		return 0;
+	}
+
+	for(int i=0; i<N; i++)
+		ASSERT(CreateThread(user, i, NULL) != NOTHREAD);
+	int f;
+	while((f = __atomic_load_n(&fx, __ATOMIC_ACQUIRE)) < N)
+		FutexWait(&fx, f, -1);
+
+	ASSERT(errors == 0);
+	ASSERT(count == N*ROUNDS);
+	ASSERT(running == 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_process_table_growth,
+	"Test that the process table grows to hold many live processes at once,\n"
+	"and that their pids are found again after they exit."
+	)
+{
+	enum { N = 600 };
+	Semaphore go = SEM_INIT(0);
+	Pid_t pids[N];
+
+	int child(int argl, void* args) {
+		ASSERT(GetPPid() == 1);
+		Sem_Down(&go);
+		return GetPid();
+	}
+
+	for(int i=0; i<N; i++) {
+		pids[i] = Exec(child, 0, NULL);
+		ASSERT(pids[i] > 1 && pids[i] < MAX_PROC);
+		for(int j=0; j<i; j++) ASSERT(pids[j] != pids[i]);
+	}
+
+	/* All the children are in the info stream */
+	Fid_t finfo = OpenInfo();
+	ASSERT(finfo != NOFILE);
+	procinfo info;
+	int count = 0;
+	while(Read(finfo, (char*) &info, sizeof(info)) == sizeof(info))
+		count++;
+	Close(finfo);
+	ASSERT(count == N + 2);
+
+	for(int i=0; i<N; i++)
+		Sem_Up(&go);
+	for(int i=0; i<N; i++) {
+		int status;
+		ASSERT(WaitChild(pids[i], &status) == pids[i]);
+		ASSERT(status == pids[i]);
+	}
+
+	/* The pids are reused */
+	Pid_t pid = Exec(child, 0, NULL);
+	ASSERT(pid > 1 && pid < N + 2);
+	Sem_Up(&go);
+	ASSERT(WaitChild(pid, NULL) == pid);
+	return 0;
+}
+
+
+BOOT_TEST(test_info_stream_reads,
+	"Test that the info stream returns the same records in pid order, whether\n"
+	"it is read many records at a time, or in pieces smaller than a record."
+	)
+{
+	enum { N = 5 };
+	Semaphore go = SEM_INIT(0);
+	int child(int argl, void* args) { Sem_Down(&go); return 0; }
+	for(int i=0; i<N; i++)
+		ASSERT(Exec(child, sizeof(i), &i) != NOPROC);
+
+	/* Many records at a time */
+	procinfo big[2*N];
+	Fid_t finfo = OpenInfo();
+	ASSERT(finfo != NOFILE);
+	ASSERT(Read(finfo, (char*) big, sizeof(big)) == (N+2)*sizeof(procinfo));
+	ASSERT(Read(finfo, (char*) big, sizeof(big)) == 0);
+	Close(finfo);
+	for(int i=0; i<N+2; i++) {
+		ASSERT(big[i].pid == i);
+		ASSERT(big[i].alive);
+	}
+	for(int i=2; i<N+2; i++) {
+		ASSERT(big[i].ppid == 1 && big[i].main_task == child);
+		ASSERT(big[i].argl == sizeof(int) && *(int*)big[i].args == i-2);
+	}
+
+	/* Pieces of 100 bytes */
+	procinfo small[N+2];
+	finfo = OpenInfo();
+	unsigned int total = 0;
+	int rc;
+	while((rc = Read(finfo, ((char*) small) + total, 100)) > 0) {
+		ASSERT(rc <= 100);
+		total += rc;
+		ASSERT(total <= sizeof(small));
+	}
+	Close(finfo);
+	ASSERT(total == sizeof(small));
+	for(int i=0; i<N+2; i++)
+		ASSERT(small[i].pid == big[i].pid && small[i].main_task == big[i].main_task);
+
+	for(int i=0; i<N; i++) Sem_Up(&go);
+	while(WaitChild(NOPROC, NULL) != NOPROC);
+	return 0;
+}
+
+
+BOOT_TEST(test_rusage,
+	"Test that GetRUsage accounts the CPU time, the waiting and the sleeps of a thread,\n"
+	"its process, and the reaped children."
+	)
+{
+	resource_usage ru, pu, cu;
+	ASSERT(GetRUsage(USAGE_THREAD, NULL) == -1);
+	ASSERT(GetRUsage(17, &ru) == -1);
+
+	/* Sleeps are counted */
+	ASSERT(GetRUsage(USAGE_THREAD, &ru) == 0);
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	for(int i=0; i<3; i++) {
+		Mutex_Lock(&mx);
+		Cond_TimedWait(&mx, &cv, 5);
+		Mutex_Unlock(&mx);
+	}
+	unsigned long sleeps = ru.sleeps;
+	ASSERT(GetRUsage(USAGE_THREAD, &ru) == 0);
+	ASSERT(ru.sleeps >= sleeps + 3);
+	ASSERT(ru.switches >= 3);
+
+	/* Two busy children on one core wait for each other */
+	volatile int stop = 0;
+	int hog(int argl, void* args) {
+		while(!stop) fibo(15);
+		return 0;
+	}
+	Pid_t c1 = Exec(hog, 0, NULL), c2 = Exec(hog, 0, NULL);
+	ASSERT(c1 != NOPROC && c2 != NOPROC);
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 300);
+	Mutex_Unlock(&mx);
+
+	procinfo info;
+	ASSERT(get_procinfo(c1, &info));
+	ASSERT(info.cpu_time > 0 && info.switches > 0);
+	if(cpu_cores() == 1)
+		ASSERT_MSG(info.wait_time > 0, "wait time %lu usec\n", info.wait_time);
+	stop = 1;
+	ASSERT(WaitChild(c1, NULL) == c1);
+	ASSERT(WaitChild(c2, NULL) == c2);
+
+	/* The children are accounted to the parent, once reaped */
+	ASSERT(GetRUsage(USAGE_CHILDREN, &cu) == 0);
+	ASSERT(cu.run_time >= info.cpu_time && cu.switches >= info.switches);
+
+	/* A thread's usage is part of the process usage */
+	ASSERT(GetRUsage(USAGE_THREAD, &ru) == 0);
+	ASSERT(GetRUsage(USAGE_PROCESS, &pu) == 0);
+	ASSERT(pu.run_time >= ru.run_time && pu.sleeps >= ru.sleeps && pu.switches >= ru.switches);
+	return 0;
+}
+
+
+BOOT_TEST(test_thread_handles,
+	"Test that thread ids are validated: a joined thread cannot be joined again,\n"
+	"even after its slot is reused, and joining an exited thread returns its status."
+	)
+{
+	int quick(int argl, void* args) { return argl; }
+
+	/* Bad handles */
+	ASSERT(ThreadJoin(NOTHREAD, NULL) == -1);
+	ASSERT(ThreadJoin((Tid_t) 0xdeadbeef, NULL) == -1);
+	ASSERT(ThreadDetach((Tid_t) 12345) == -1);
+	ASSERT(ThreadJoin(ThreadSelf(), NULL) == -1);
+
+	/* Join a thread after it has exited */
+	Tid_t t = CreateThread(quick, 42, NULL);
+	ASSERT(t != NOTHREAD);
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 20);
+	Mutex_Unlock(&mx);
+	int exitval = 0;
+	ASSERT(ThreadJoin(t, &exitval) == 0);
+	ASSERT(exitval == 42);
+
+	/* The handle is now stale, also when the slot is taken by a new thread */
+	ASSERT(ThreadJoin(t, NULL) == -1);
+	Tid_t t2 = CreateThread(quick, 7, NULL);
+	ASSERT(t2 != t);
+	ASSERT(ThreadJoin(t, NULL) == -1);
+	ASSERT(ThreadDetach(t) == -1);
+	ASSERT(ThreadJoin(t2, &exitval) == 0 && exitval == 7);
+
+	/* Many threads, joined in reverse order */
+	enum { N = 200 };
+	Tid_t tids[N];
+	for(int i=0; i<N; i++)
+		ASSERT((tids[i] = CreateThread(quick, i, NULL)) != NOTHREAD);
+	for(int i=N-1; i>=0; i--) {
+		ASSERT(ThreadJoin(tids[i], &exitval) == 0);
+		ASSERT(exitval == i);
+	}
+
+	/* A detached thread cannot be joined */
+	Semaphore go = SEM_INIT(0);
+	int waiter(int argl, void* args) { Sem_Down(&go); return 0; }
+	t = CreateThread(waiter, 0, NULL);
+	ASSERT(ThreadDetach(t) == 0);
+	ASSERT(ThreadJoin(t, NULL) == -1);
+	Sem_Up(&go);
+	return 0;
+}
+
+
 TEST_SUITE(user_tests, 
 	"These are tests defined by the user."
 	)
 {
 	&dummy_user_test,
+	&test_many_timed_waits,
+	&test_create_thread_stack,
+	&test_thread_affinity,
+	&test_fair_policy,
+	&test_cpu_share,
+	&test_cpu_quota,
+	&test_cpu_quota_lock_holder,
+	&test_fair_share_processes,
+	&test_cond_handoff,
+	&test_cond_broadcast_morph,
+	&test_mutex_sleep,
+	&test_mutex_owner_exits,
+	&test_io_close_while_in_use,
+	&test_rwlock,
+	&test_semaphore,
+	&test_futex,
+	&test_process_table_growth,
+	&test_info_stream_reads,
+	&test_rusage,
+	&test_thread_handles,
 	NULL
 };
 